@@ -3,292 +3,2401 @@
 #include <SDL2/SDL.h>
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "util.h"
 #include "measure.h"
 
+/* the big bench scenes want something like -DN_BODY=1048576 */
+#ifndef N_BODY
 #define N_BODY 4096
-#define PHYSICS_ITERATIONS (8 * 60)
-#define PHYSICS_TIME (1.0 / PHYSICS_ITERATIONS)
+#endif
+#define N_HANDLE (N_BODY * 16)
+
+/* 
+ * a handle is its slot in the handle bitmap with the generation of the
+ * slot above HANDLE_INDEX_BITS. freeing a slot bumps its generation, so a
+ * handle kept after its body is gone never reaches the next one.
+ */
+#define HANDLE_INDEX_BITS (N_HANDLE <= 1 << 16 ? 16 : N_HANDLE <= 1 << 20 ? 20 : 24)
+#define HANDLE_GENERATION_MASK ((1u << (31 - HANDLE_INDEX_BITS)) - 1)
+#define HANDLE_INDEX(H) ((H) & ((1 << HANDLE_INDEX_BITS) - 1))
+#define HANDLE_GENERATION(H) ((unsigned int)(H) >> HANDLE_INDEX_BITS)
+#define MAKE_HANDLE(I, G) ((int)((unsigned int)(G) << HANDLE_INDEX_BITS | (unsigned int)(I)))
+#if N_HANDLE > 1 << 24
+#error "N_BODY too big for the handle layout"
+#endif
+#define COMMAND_RING_SIZE 1024
+#define COMMAND_RING_MASK (COMMAND_RING_SIZE - 1)
+#define PHYSICS_ITERATIONS (2 * 60)
+#define PHYSICS_TIME ((Float)1.0 / PHYSICS_ITERATIONS)
+
+/* 
+ * 0 makes every contact fully inelastic, picked per batch not per pair,
+ * build with -DPHYSICS_RESTITUTION=0 for it
+ */
+#ifndef PHYSICS_RESTITUTION
+#define PHYSICS_RESTITUTION 1
+#endif
+
+/* 
+ * contacts are solved with sequential impulses, SOLVER_ITERATIONS passes
+ * per step by default (see world_iterations). penetration past
+ * SOLVER_SLOP is fed back as velocity, SOLVER_BAUMGARTE of it per step,
+ * and restitution is ignored below SOLVER_BOUNCE_SPEED so stacks rest.
+ */
+#define SOLVER_ITERATIONS 8
+#define SOLVER_ITERATIONS_MAX 64
+#define SOLVER_BAUMGARTE FLOAT_C(0.2)
+#define SOLVER_SLOP FLOAT_C(0.5)
+#define SOLVER_BOUNCE_SPEED FLOAT_C(20.0)
+#define GRAVITY (FLOAT_C(19.4) * 4)
+
+/* 
+ * the broadphase runs once every PAIR_REUSE_STEPS steps (once per 60 Hz
+ * frame), bodies enter the grid grown by how far their velocity carries
+ * them until the next rebuild plus PAIR_MARGIN, and the steps in between
+ * only repeat the narrowphase on the same pairs. a body leaving its grown
+ * box forces a rebuild, up to PAIR_INSERT_MAX new bodies are paired
+ * without one.
+ */
+#define PAIR_REUSE_STEPS (PHYSICS_ITERATIONS / 60)
+#define PAIR_MARGIN FLOAT_C(1.0)
+#define PAIR_INSERT_MAX 32
+
+/* seconds between two bodies of the demo spawner */
+#define SPAWN_INTERVAL 0.00625
+
+/* 
+ * initial slot count of the cell table, always a power of two. it doubles
+ * when half full and halves again once under 1/8 full for
+ * GRID_SHRINK_REBUILDS rebuilds in a row.
+ */
+#define GRID_CELLS_MIN 1024
+#define GRID_SHRINK_REBUILDS 64
+
+/* 
+ * the grid is hierarchical: level L has cells of grid_tile_size << L,
+ * each body lives in the first level where its extent, grown as in
+ * fat_extent, fits a cell, so it touches 1 to 4 cells no matter how big
+ * or fast it is.
+ */
+#define GRID_LEVELS 12
+#define GRID_TILE_SIZE_MIN 4
+#define GRID_TILE_SIZE_MAX 256
+
+/* 
+ * the world is split in CHUNK_SIZE chunks: chunks around a focus point are
+ * stepped every step, a ring around those every CHUNK_LOW_RATE_STEPS, and
+ * the rest is frozen and written to CHUNK_DIR after CHUNK_SPILL_STEPS.
+ */
+#define CHUNK_SIZE 1024
+#define CHUNK_TABLE_MIN 4096
+#define CHUNK_ACTIVE_RADIUS 1
+#define CHUNK_LOW_RATE_RADIUS 2
+#define CHUNK_LOW_RATE_STEPS 8
+#define CHUNK_SPILL_STEPS (PHYSICS_ITERATIONS * 10)
+#define CHUNK_DIR "chunks"
+#define MAX_FOCUS 8
+
+/* 
+ * headless sharding: the world is cut in SHARD_WIDTH strips along x, one
+ * process each, bodies within SHARD_HALO of a border are mirrored to the
+ * neighbor as static ghosts every step.
+ */
+#define SHARD_MAX 16
+#define SHARD_WIDTH 1024
+#define SHARD_HALO 32
+#define SHARD_RING_SIZE 8192
+#define SHARD_RING_MASK (SHARD_RING_SIZE - 1)
+
+/* 
+ * generated scenes are laid out so there is one body per SCENE_SPACING
+ * squared of world, bench sweeps double the count from BENCH_MIN_BODIES
+ */
+#define SCENE_SPACING 16
+#define SCENE_CLUSTER_BODIES 1024
+#define SCENE_PILE_WIDTH 8
+#define SCENE_TILE_SIZE 4
+#define BENCH_MIN_BODIES 1024
+
+/* set to 0 to draw every body in the same color */
+#define RENDER_STATE_COLORS 1
+/* bodies slower than this are drawn as resting */
+#define RESTING_SPEED 2.0
+
+/* 
+ * build with -DPHYSICS_DOUBLE for double precision, FLOAT_C and the math
+ * wrappers keep the hot paths free of float/double conversions
+ */
+#ifdef PHYSICS_DOUBLE
+typedef double Float;
+#define FLOAT_C(X) (X)
+#define FABS(X) fabs(X)
+#define FLOOR(X) floor(X)
+#define FMAX(A, B) fmax(A, B)
+#else
+typedef float Float;
+#define FLOAT_C(X) (X##f)
+#define FABS(X) fabsf(X)
+#define FLOOR(X) floorf(X)
+#define FMAX(A, B) fmaxf(A, B)
+#endif
+
+/* 
+ * build with -DBODY_COMPACT to keep half sizes as 14.2 fixed point, a
+ * body then takes 28 bytes instead of 32 in the hot loops. always write
+ * them through HALF_SIZE and read them through BODY_HALF.
+ */
+#ifdef BODY_COMPACT
+typedef uint16_t HalfSize;
+#define HALF_SIZE_SCALE 4
+#define HALF_SIZE(X) ((HalfSize)((X) * HALF_SIZE_SCALE + 0.5))
+#define BODY_HALF(B, I) ((Float)(B)->half_size[I] * (FLOAT_C(1.0) / HALF_SIZE_SCALE))
+#else
+typedef Float HalfSize;
+#define HALF_SIZE(X) ((HalfSize)(X))
+#define BODY_HALF(B, I) ((B)->half_size[I])
+#endif
+
+/* 
+ * gravity is the same for every body, anything else goes through
+ * body_force and lives in body_forces for one step only
+ */
+typedef struct {
+	Float position[2];
+	Float velocity[2];
+	HalfSize half_size[2];
+	
+	/* 0 for static bodies, so kernels never need to ask */
+	Float inv_mass;
+	unsigned char material;
+} Body;
+
+#define BODY_STATIC(B) ((B)->inv_mass == 0)
+
+enum {
+	MATERIAL_STONE,
+	MATERIAL_WOOD,
+	MATERIAL_RUBBER,
+	MATERIAL_METAL,
+	MATERIAL_ICE,
+	MATERIAL_COUNT
+};
+
+typedef struct {
+	Float restitution;
+	Float friction;
+} Material;
+
+/* what a contact between two materials uses, filled by init_materials */
+typedef struct {
+	Float bounce;
+	Float friction;
+} MaterialPair;
+
+enum {
+	BODY_STATE_FREE,
+	BODY_STATE_CONTACT,
+	BODY_STATE_CROWDED,
+	BODY_STATE_RESTING,
+	BODY_STATE_STATIC,
+	BODY_STATE_COUNT
+};
+
+/* 
+ * read-only copy of what the renderer needs, published by the simulation
+ * thread through a triple buffer (see publish_snapshot/take_snapshot)
+ */
+typedef struct {
+	int count;
+	Uint64 published;
+	int handle[N_BODY];
+	Float position[N_BODY][2];
+	Float half_size[N_BODY][2];
+	unsigned char state[N_BODY];
+} Snapshot;
+
+/* how a body takes part in the broadphase */
+enum {
+	GRID_ROLE_NONE,
+	GRID_ROLE_DYNAMIC,
+	GRID_ROLE_STATIC
+};
+
+enum {
+	SCENE_UNIFORM,
+	SCENE_CLUSTERS,
+	SCENE_PILES,
+	SCENE_TILEMAP,
+	SCENE_MIXED,
+	SCENE_COUNT
+};
+
+enum {
+	COMMAND_SPAWN,
+	COMMAND_DESTROY,
+	COMMAND_IMPULSE,
+	COMMAND_SET_VELOCITY,
+	COMMAND_FORCE,
+	COMMAND_FOCUS,
+	COMMAND_UNFOCUS,
+	COMMAND_ITERATIONS
+};
+
+typedef struct {
+	int type;
+	int handle;
+	union {
+		Body body;
+		Float vector[2];
+	};
+} Command;
+
+/* force accumulated on a handle, applied and dropped by the next step */
+typedef struct {
+	int handle;
+	Float force[2];
+} Force;
+
+/* 
+ * slot of the command ring, sequence tells whose turn it is: equal to the
+ * position when free for a producer, position + 1 once the command is
+ * written and the simulation can take it.
+ */
+typedef struct {
+	SDL_atomic_t sequence;
+	Command command;
+} CommandSlot;
+
+enum {
+	CHUNK_FROZEN,
+	CHUNK_LOW_RATE,
+	CHUNK_ACTIVE
+};
+
+typedef struct {
+	Body body;
+	int handle;
+} StoredBody;
+
+/* 
+ * bodies of loaded chunks live in body_list, frozen ones are kept in
+ * stored (as StoredBody) until the chunk is spilled to disk. a frozen
+ * static body reaching into other chunks is stored in the one holding
+ * its center, the others get that chunk in links (as int[2]) to wake it.
+ */
+typedef struct {
+	int x, y;
+	int used, deleted;
+	int state, next_state;
+	int border;
+	int resident, on_disk;
+	int frozen_steps;
+	ArrayBuffer stored;
+	ArrayBuffer links;
+} Chunk;
+
+/* 
+ * single producer/consumer ring living in shared memory, the neighbor on
+ * one side writes, the shard owning it reads. ghosts have handle -1.
+ */
+typedef struct {
+	SDL_atomic_t head, tail;
+	StoredBody items[SHARD_RING_SIZE];
+} ShardRing;
+
+typedef struct {
+	pthread_barrier_t barrier;
+	int count;
+	SDL_atomic_t bodies[SHARD_MAX];
+	ShardRing rings[SHARD_MAX][2];
+} ShardShared;
+
+enum {
+	PAIR_DYNAMIC,
+	PAIR_STATIC,
+	PAIR_BATCHES
+};
+
+/* ids into body_list, for PAIR_STATIC b is the static (or frozen) one */
+typedef struct {
+	int a, b;
+} BodyPair;
+
+/* 
+ * a touching pair ready for the solver, normal goes from a to b and the
+ * impulses are accumulated over the iterations of one step
+ */
+typedef struct {
+	int a, b;
+	Float normal[2];
+	Float bias;
+	Float mass;
+	Float friction;
+	Float normal_impulse;
+	Float tangent_impulse;
+} Contact;
+
+typedef struct {
+	int next, prev;
+	Body *body;
+
+	int cell[2];
+	int min[2];
+} BodyNodeList;
+
+/* 
+ * a slot of the open addressed cell table, it is only alive when its
+ * generation is the current grid_generation, so clearing the grid is
+ * just bumping the counter.
+ */
+typedef struct {
+	int level, x, y;
+	unsigned int generation;
+	int bodies, static_bodies;
+} GridCell;
+
+#define RAND_FLOAT (rand() / (Float)RAND_MAX)
+#define RAND(MIN, MAX) (RAND_FLOAT * (MAX - MIN) + MIN)
+
+static inline uint_fast32_t hash_pos(uint_fast32_t x, uint_fast32_t y, uint_fast32_t level)
+{
+	uint_fast32_t h = (x * 0x9E3779B1u) ^ (y * 0x85EBCA77u) ^ (level * 0xC2B2AE3Du);
+	return (h ^ (h >> 15)) & 0xFFFFFFFFu;
+}
+
+static void solve_body(Body *body, Float delta);
+static void solve_body_grid_list(int grid_list, int other_grid, Float delta);
+static void solve_body_grid_list_static(int grid_list, int other_grid, Float delta);
+static void solve_body_grid(int body_node, int other_grid, Float delta);
+static void solve_body_grid_static(int body_node, int other_grid, Float delta);
+static void update_body(Body *body, Float delta);
+static void apply_forces();
+static void move_body(Body *body, Float delta);
+static int  body_state(int id);
+static void render_world();
+
+int body_spawn(const Body *);
+int body_destroy(int handle);
+int body_impulse(int handle, Float x, Float y);
+int body_force(int handle, Float x, Float y);
+int body_set_velocity(int handle, Float x, Float y);
+
+int world_focus(int id, Float x, Float y);
+int world_unfocus(int id);
+int world_iterations(int iterations);
+
+static int  push_command(const Command *);
+static void drain_commands();
+static void run_command(const Command *);
+static void run_stored_command(const Command *, int slot);
+static int  alloc_handle();
+static void free_handle(int handle);
+static void mark_handle(int handle);
+static int  handle_slot(int handle);
+static int  add_body(const Body *, int handle);
+static void remove_body(int id);
+
+static Chunk *find_chunk(int x, int y, int create);
+static Chunk *chunk_at(const Body *);
+static void   chunk_span(const Body *, int min[2], int max[2]);
+static int    span_state(const Body *, const Chunk *home);
+static int    make_resident(Chunk *);
+static void   store_body(Chunk *, const Body *, int handle);
+static void   freeze_body(int id);
+static void   stream_in_chunk(Chunk *);
+static void   stream_in_links(Chunk *);
+static int    spill_chunk(Chunk *);
+static void   update_chunks();
+static void   release_chunk(Chunk *);
+static void   rehash_chunks();
+static void   assign_chunks(int low_rate_tick);
+
+static void init_world();
+static void init_materials();
+static int  run_shards(int count, int steps);
+static void shard_worker(ShardShared *, int shard, const Body *scene, int scene_count, int steps);
+static void shard_exchange(ShardShared *, int shard);
+static int  shard_push(ShardRing *, const Body *, int handle);
+
+static int  simulation_thread(void *);
+static void step_world();
+static void begin_step();
+static void finish_step();
+static void update_pairs();
+static void insert_pairs();
+static void publish_snapshot();
+static int  take_snapshot();
+
+static BodyNodeList *blist(int id);
+static void          add_body_list(int *body_list, Body *, int x, int y, int min_x, int min_y);
+static GridCell     *grid_cell(int level, int x, int y, int create);
+static void          grow_grid_cells();
+static void          shrink_grid_cells();
+static void          clear_lists();
+static void          calculate_grid();
+static void          calculate_grid_body(Body *, int as_static);
+static void          select_grid_tile_size();
+static int           grid_level(Body *);
+static int           grid_role(int id);
+static void          fat_extent(Body *, Float fat[2]);
+static void          grid_range(Body *, int level, int min[2], int max[2]);
+static void          solve_body_cross_level(Body *);
+static void          query_grid_level(Body *, int level, int is_static);
+static void          emit_pair(int batch, Body *, Body *);
+static void          find_pairs();
+static void          solve_pairs();
+
+int         check_collision(Body *body, Body *body2, Float delta, Float hit_position[2], Float hit_normal[2], Float pen_vector[2]);
+static void prepare_dynamic_contacts(const BodyPair *, int count, ArrayBuffer *contacts);
+static void prepare_dynamic_contacts_inelastic(const BodyPair *, int count, ArrayBuffer *contacts);
+static void prepare_static_contacts(const BodyPair *, int count, ArrayBuffer *contacts);
+static void prepare_static_contacts_inelastic(const BodyPair *, int count, ArrayBuffer *contacts);
+static void solve_dynamic_contacts(Contact *, int count);
+static void solve_static_contacts(Contact *, int count);
+
+static int  run_verify(unsigned int seed, int count, int steps);
+static void add_verify_body(int i);
+static void record_pairs(ArrayBuffer *log);
+static int  compare_pair(const void *, const void *);
+
+static int  run_bench(int scene, int count, unsigned int seed, int steps);
+static int  bench_scene(int scene, int count, unsigned int seed, int steps);
+static int  find_scene(const char *name);
+static void generate_scene(ArrayBuffer *scene, int type, int count, unsigned int seed);
+static Body scene_body(Float x, Float y, Float w, Float h);
+
+static SDL_Window *window;
+static SDL_Renderer *renderer;
+static Body body_list[N_BODY];
+static ArrayBuffer body_node_buffer;
+static int body_count;
+
+/* 
+ * snapshot_middle holds the index of the buffer not owned by either
+ * thread, with SNAPSHOT_FRESH set when the simulation put a new one there
+ */
+#define SNAPSHOT_FRESH 4
+static Snapshot snapshots[3];
+static SDL_atomic_t snapshot_middle;
+static int snapshot_write = 1, snapshot_read = 2;
+static Snapshot render_prev;
+
+static const SDL_Color state_colors[BODY_STATE_COUNT] = {
+	[BODY_STATE_FREE]    = { 255, 0,   0,   255 },
+	[BODY_STATE_CONTACT] = { 255, 128, 0,   255 },
+	[BODY_STATE_CROWDED] = { 255, 255, 0,   255 },
+	[BODY_STATE_RESTING] = { 0,   128, 255, 255 },
+	[BODY_STATE_STATIC]  = { 128, 128, 128, 255 },
+};
+static ArrayBuffer render_rects[BODY_STATE_COUNT];
+static int body_contacts[N_BODY];
+
+/* 
+ * any thread may push commands, only the simulation drains them at the
+ * start of a step. handles are allocated straight from a bitmap so the
+ * producer knows the handle of a body before it exists.
+ */
+static CommandSlot command_ring[COMMAND_RING_SIZE];
+static SDL_atomic_t command_tail;
+static unsigned int command_head;
+static SDL_atomic_t handle_bitmap[N_HANDLE / 32];
+/* word where alloc_handle starts looking, only a hint, races are fine */
+static SDL_atomic_t handle_hint;
+/* written by whoever frees the slot, before the bitmap lets it go */
+static unsigned short handle_generation[N_HANDLE];
+static int handle_body[N_HANDLE];
+/* chunk holding the body of a handle while it is frozen, else -1 */
+static int handle_chunk[N_HANDLE];
+static int body_handle[N_BODY];
+
+/* 
+ * open addressed, empty chunks are released as tombstones and the table
+ * is rebuilt (bigger if needed) once live chunks and tombstones fill half
+ */
+static Chunk *chunk_table;
+static unsigned int chunk_table_mask;
+static int chunk_count, chunk_tombstones;
+static ArrayBuffer resident_chunks;
+static Float focus[MAX_FOCUS][2];
+static int focus_used[MAX_FOCUS];
+static int body_chunk[N_BODY];
+static int body_rate[N_BODY];
+static int chunk_stats[3];
+static unsigned int world_steps;
+static int chunk_streaming = 1;
+static char body_ghost[N_BODY];
+
+static SDL_atomic_t running;
+static SDL_atomic_t frames_rendered;
+
+static GridCell *grid_cells;
+static unsigned int grid_cells_mask;
+static unsigned int grid_generation;
+static ArrayBuffer grid_occupied;
+static int grid_sparse_rebuilds;
+static int grid_sparse_peak;
+
+static int grid_tile_size = 16;
+static int grid_tile_body_count = -1;
+static int body_level[N_BODY];
+static char grid_static[N_BODY];
+static ArrayBuffer grid_bodies;
+static int grid_level_count[GRID_LEVELS];
+static int static_grid_level_count[GRID_LEVELS];
+
+static int max_object_count = 0;
+static int object_count = 0;
+static int object_sum = 0;
+static int cell_sum = 0;
+static int iterations = 0;
+static int count_20 = 0;
+
+static ArrayBuffer pair_batch[PAIR_BATCHES];
+static ArrayBuffer contact_batch[PAIR_BATCHES];
+static ArrayBuffer body_forces;
+static int world_restitution = PHYSICS_RESTITUTION;
+static int pair_age = PAIR_REUSE_STEPS;
+static int pairs_dirty;
+
+/* bodies below pair_bodies are in the batches, binned at their fat origin */
+static int pair_bodies;
+static Float body_fat_origin[N_BODY][2];
+static Float body_fat_slack[N_BODY][2];
+static int solver_iterations = SOLVER_ITERATIONS;
+
+static const Material materials[MATERIAL_COUNT] = {
+	[MATERIAL_STONE]  = { .restitution = FLOAT_C(0.5),  .friction = FLOAT_C(0.8)  },
+	[MATERIAL_WOOD]   = { .restitution = FLOAT_C(0.1),  .friction = FLOAT_C(0.5)  },
+	[MATERIAL_RUBBER] = { .restitution = FLOAT_C(0.45), .friction = FLOAT_C(1.0)  },
+	[MATERIAL_METAL]  = { .restitution = FLOAT_C(0.25), .friction = FLOAT_C(0.3)  },
+	[MATERIAL_ICE]    = { .restitution = FLOAT_C(0.05), .friction = FLOAT_C(0.05) },
+};
+static MaterialPair material_pairs[MATERIAL_COUNT][MATERIAL_COUNT];
+
+static const char *scene_names[SCENE_COUNT] = {
+	[SCENE_UNIFORM]  = "uniform",
+	[SCENE_CLUSTERS] = "clusters",
+	[SCENE_PILES]    = "piles",
+	[SCENE_TILEMAP]  = "tilemap",
+	[SCENE_MIXED]    = "mixed",
+};
+
+int
+main(int argc, char *argv[])
+{
+	if(argc > 1 && strcmp(argv[1], "shard") == 0)
+		return run_shards(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? atoi(argv[3]) : PHYSICS_ITERATIONS * 5);
+	if(argc > 1 && strcmp(argv[1], "verify") == 0)
+		return run_verify(argc > 2 ? atoi(argv[2]) : 1, argc > 3 ? atoi(argv[3]) : N_BODY / 2, argc > 4 ? atoi(argv[4]) : PHYSICS_ITERATIONS);
+	if(argc > 1 && strcmp(argv[1], "bench") == 0)
+		return run_bench(argc > 2 ? find_scene(argv[2]) : SCENE_UNIFORM, argc > 3 ? atoi(argv[3]) : 0,
+				argc > 4 ? atoi(argv[4]) : 1, argc > 5 ? atoi(argv[5]) : PHYSICS_ITERATIONS);
+
+	SDL_Init(SDL_INIT_VIDEO);
+	window = SDL_CreateWindow("hello",
+			SDL_WINDOWPOS_CENTERED,
+			SDL_WINDOWPOS_CENTERED,
+			800, 600,
+			SDL_WINDOW_OPENGL);
+	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+	for(int i = 0; i < BODY_STATE_COUNT; i++)
+		arrbuf_init(&render_rects[i]);
+
+	init_world();
+	world_focus(0, 400, 300);
+
+	static const Body walls[] = {
+		{ .position = { 400, 500 }, .half_size = { HALF_SIZE(100), HALF_SIZE(5) }, .material = MATERIAL_STONE },
+		{ .position = { 500, 400 }, .half_size = { HALF_SIZE(5), HALF_SIZE(100) }, .material = MATERIAL_STONE },
+		{ .position = { 400, 550 }, .half_size = { HALF_SIZE(400), HALF_SIZE(10) }, .material = MATERIAL_STONE },
+		{ .position = { 5,   300 }, .half_size = { HALF_SIZE(10), HALF_SIZE(300) }, .material = MATERIAL_STONE },
+		{ .position = { 750, 300 }, .half_size = { HALF_SIZE(10), HALF_SIZE(300) }, .material = MATERIAL_STONE },
+	};
+	for(int i = 0; i < (int)LENGTH(walls); i++)
+		body_spawn(&walls[i]);
+
+	SDL_AtomicSet(&running, 1);
+	publish_snapshot();
+	SDL_Thread *simulation = SDL_CreateThread(simulation_thread, "simulation", NULL);
+	if(!simulation)
+		die("could not create simulation thread: %s\n", SDL_GetError());
+
+	for(;;) {
+		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+		SDL_RenderClear(renderer);
+
+		render_world();
+
+		SDL_RenderPresent(renderer);
+		SDL_AtomicAdd(&frames_rendered, 1);
+
+		SDL_Event event;
+		while(SDL_PollEvent(&event)) {
+			switch(event.type) {
+			case SDL_QUIT:
+				goto end_game;
+				break;
+			}
+		}
+	}
+
+end_game:
+	SDL_AtomicSet(&running, 0);
+	SDL_WaitThread(simulation, NULL);
+	for(int i = 0; i < BODY_STATE_COUNT; i++)
+		arrbuf_free(&render_rects[i]);
+	SDL_DestroyRenderer(renderer);
+	SDL_DestroyWindow(window);
+	SDL_Quit();
+
+	return 0;
+}
+
+static void
+init_world()
+{
+	arrbuf_init(&body_node_buffer);
+	arrbuf_init(&grid_occupied);
+	arrbuf_init(&grid_bodies);
+	arrbuf_init(&resident_chunks);
+	arrbuf_init(&body_forces);
+	for(int i = 0; i < PAIR_BATCHES; i++) {
+		arrbuf_init(&pair_batch[i]);
+		arrbuf_init(&contact_batch[i]);
+	}
+	clear_lists();
+
+	for(int i = 0; i < COMMAND_RING_SIZE; i++)
+		SDL_AtomicSet(&command_ring[i].sequence, i);
+	for(int i = 0; i < N_HANDLE; i++) {
+		handle_body[i] = -1;
+		handle_chunk[i] = -1;
+	}
+	init_materials();
+}
+
+/* 
+ * contacts add both restitutions like bodies used to, friction is the
+ * geometric mean of both
+ */
+static void
+init_materials()
+{
+	for(int a = 0; a < MATERIAL_COUNT; a++)
+	for(int b = 0; b < MATERIAL_COUNT; b++) {
+		material_pairs[a][b].bounce = 1 + materials[a].restitution + materials[b].restitution;
+		material_pairs[a][b].friction = sqrt(materials[a].friction * materials[b].friction);
+	}
+}
+
+static int
+simulation_thread(void *data)
+{
+	Uint64 prev_time = SDL_GetPerformanceCounter();
+	double physics_time = 0, spawn_time = 0;
+	double fps_time = 0, physics_time_avg = 0;
+	int flip = 0;
+
+	while(SDL_AtomicGet(&running)) {
+		Uint64 curr_time = SDL_GetPerformanceCounter();
+		double delta = (double)(curr_time - prev_time) / SDL_GetPerformanceFrequency();
+		prev_time = curr_time;
+		if(delta > 0.25)
+			delta = 0.25;
+
+		physics_time += delta;
+		if(physics_time > PHYSICS_TIME) {
+			Uint64 start = SDL_GetPerformanceCounter();
+			while(physics_time > PHYSICS_TIME) {
+				step_world();
+
+				physics_time -= PHYSICS_TIME;
+				spawn_time += PHYSICS_TIME;
+				while(spawn_time > SPAWN_INTERVAL) {
+					flip = (flip + 1) % 2;
+					body_spawn(&(Body){
+						.half_size = { HALF_SIZE(RAND(2, 5)), HALF_SIZE(RAND(2, 5)) },
+						.position = { 50 + flip * 500, 50 },
+						.velocity = { RAND(0.0, 200.0) * -(flip * 2 - 1), 0.0 },
+						.inv_mass = 1 / RAND(5, 10),
+						.material = rand() % MATERIAL_COUNT,
+					});
+					spawn_time -= SPAWN_INTERVAL;
+				}
+			}
+			Uint64 end = SDL_GetPerformanceCounter();
+			physics_time_avg += 1000.0 * (end - start) / SDL_GetPerformanceFrequency();
+
+			publish_snapshot();
+		} else {
+			SDL_Delay(1);
+		}
+
+		fps_time += delta; 
+		if(fps_time > 1.0) {
+			int frames = SDL_AtomicSet(&frames_rendered, 0);
+
+			printf("FPS: %d | SYM_TIME: %f | BODY_COUNT: %d | CHUNKS: %d/%d/%d | MAX: %d | AVG: %f | 20: %f\n",
+					frames,
+					physics_time_avg / (frames ? frames : 1),
+					body_count, 
+					chunk_stats[CHUNK_ACTIVE],
+					chunk_stats[CHUNK_LOW_RATE],
+					chunk_stats[CHUNK_FROZEN],
+					max_object_count, 
+					object_sum / (float)cell_sum, 
+					(float)count_20 / iterations);
+
+			count_20 = 0;
+			object_sum = 0;
+			cell_sum = 0;
+			physics_time_avg = 0;
+			fps_time = 0;
+			iterations = 0;
+		}
+	}
+
+	return 0;
+}
+
+static void
+step_world()
+{
+	begin_step();
+	finish_step();
+}
+
+/* everything up to the pairs about to be solved, verify looks in between */
+static void
+begin_step()
+{
+	int low_rate_tick = world_steps++ % CHUNK_LOW_RATE_STEPS == 0;
+
+	iterations++;
+	drain_commands();
+	if(low_rate_tick && chunk_streaming) {
+		update_chunks();
+		pairs_dirty = 1;
+	}
+	assign_chunks(low_rate_tick);
+	memset(body_contacts, 0, body_count * sizeof(body_contacts[0]));
+	for(int i = 0; i < body_count; i++)
+		if(body_rate[i])
+			update_body(&body_list[i], PHYSICS_TIME * body_rate[i]);
+	apply_forces();
+	update_pairs();
+}
+
+static void
+finish_step()
+{
+	solve_pairs();
+	for(int i = 0; i < body_count; i++) {
+		Body *b = &body_list[i];
+
+		if(!body_rate[i])
+			continue;
+		move_body(b, PHYSICS_TIME * body_rate[i]);
+
+		/* out of the box it was binned with, its pairs may be missing */
+		if(FABS(b->position[0] - body_fat_origin[i][0]) > body_fat_slack[i][0] ||
+		   FABS(b->position[1] - body_fat_origin[i][1]) > body_fat_slack[i][1])
+			pairs_dirty = 1;
+	}
+	alloc_step();
+}
+
+/* 
+ * rebuilds the pairs when due or when something invalidated them, else
+ * keeps them and only pairs up the bodies added since
+ */
+static void
+update_pairs()
+{
+	if(pairs_dirty || ++pair_age >= PAIR_REUSE_STEPS || body_count - pair_bodies > PAIR_INSERT_MAX) {
+		find_pairs();
+		pair_age = 0;
+		pairs_dirty = 0;
+	} else if(pair_bodies < body_count) {
+		insert_pairs();
+	}
+	pair_bodies = body_count;
+}
+
+/* 
+ * new bodies against the fat boxes everything was binned with, a plain
+ * loop over all bodies is cheaper than a rebuild while only a few are new
+ */
+static void
+insert_pairs()
+{
+	for(int i = pair_bodies; i < body_count; i++) {
+		int role = grid_role(i);
+		Float fat[2];
+
+		if(role == GRID_ROLE_NONE)
+			continue;
+		fat_extent(&body_list[i], fat);
+		body_fat_origin[i][0] = body_list[i].position[0];
+		body_fat_origin[i][1] = body_list[i].position[1];
+		body_fat_slack[i][0] = fat[0] - BODY_HALF(&body_list[i], 0);
+		body_fat_slack[i][1] = fat[1] - BODY_HALF(&body_list[i], 1);
+
+		for(int j = 0; j < i; j++) {
+			int other = grid_role(j);
+
+			if(other == GRID_ROLE_NONE || (role == GRID_ROLE_STATIC && other == GRID_ROLE_STATIC))
+				continue;
+			if(FABS(body_fat_origin[i][0] - body_fat_origin[j][0]) > fat[0] + BODY_HALF(&body_list[j], 0) + body_fat_slack[j][0] ||
+			   FABS(body_fat_origin[i][1] - body_fat_origin[j][1]) > fat[1] + BODY_HALF(&body_list[j], 1) + body_fat_slack[j][1])
+				continue;
+
+			if(other == GRID_ROLE_STATIC)
+				emit_pair(PAIR_STATIC, &body_list[i], &body_list[j]);
+			else if(role == GRID_ROLE_STATIC)
+				emit_pair(PAIR_STATIC, &body_list[j], &body_list[i]);
+			else
+				emit_pair(PAIR_DYNAMIC, &body_list[i], &body_list[j]);
+		}
+	}
+}
+
+/* 
+ * runs the broadphase, leaving every candidate pair in its batch: pairs
+ * against static bodies go apart from the dynamic ones so each batch runs
+ * its own branch-free kernel.
+ */
+static void
+find_pairs()
+{
+	for(int i = 0; i < PAIR_BATCHES; i++)
+		arrbuf_clear(&pair_batch[i]);
+
+	calculate_grid();
+	max_object_count = 0;
+	int cells = arrbuf_length(&grid_occupied, sizeof(int));
+	for(int i = 0; i < cells; i++) {
+		GridCell *cell = &grid_cells[((int*)grid_occupied.data)[i]];
+		object_count = 0;
+
+		solve_body_grid_list(cell->bodies, cell->bodies, PHYSICS_TIME);
+		solve_body_grid_list_static(cell->bodies, cell->static_bodies, PHYSICS_TIME);
+		if(object_count > max_object_count)
+			max_object_count = object_count;
+
+		object_sum += object_count;
+		if(object_count > 20)
+			count_20 ++;
+	}
+	cell_sum += cells;
+
+	int count = arrbuf_length(&grid_bodies, sizeof(int));
+	for(int i = 0; i < count; i++)
+		solve_body_cross_level(&body_list[((int*)grid_bodies.data)[i]]);
+}
+
+/* 
+ * turns the touching pairs into contacts and runs the iteration budget
+ * over them, the static batch goes last so walls get the final word
+ */
+static void
+solve_pairs()
+{
+	const BodyPair *dynamic = pair_batch[PAIR_DYNAMIC].data;
+	const BodyPair *stat = pair_batch[PAIR_STATIC].data;
+	int dynamic_count = arrbuf_length(&pair_batch[PAIR_DYNAMIC], sizeof(BodyPair));
+	int static_count = arrbuf_length(&pair_batch[PAIR_STATIC], sizeof(BodyPair));
+
+	for(int i = 0; i < PAIR_BATCHES; i++)
+		arrbuf_clear(&contact_batch[i]);
+
+	if(world_restitution) {
+		prepare_dynamic_contacts(dynamic, dynamic_count, &contact_batch[PAIR_DYNAMIC]);
+		prepare_static_contacts(stat, static_count, &contact_batch[PAIR_STATIC]);
+	} else {
+		prepare_dynamic_contacts_inelastic(dynamic, dynamic_count, &contact_batch[PAIR_DYNAMIC]);
+		prepare_static_contacts_inelastic(stat, static_count, &contact_batch[PAIR_STATIC]);
+	}
+
+	dynamic_count = arrbuf_length(&contact_batch[PAIR_DYNAMIC], sizeof(Contact));
+	static_count = arrbuf_length(&contact_batch[PAIR_STATIC], sizeof(Contact));
+	for(int i = 0; i < solver_iterations; i++) {
+		solve_dynamic_contacts(contact_batch[PAIR_DYNAMIC].data, dynamic_count);
+		solve_static_contacts(contact_batch[PAIR_STATIC].data, static_count);
+	}
+}
+
+/* 
+ * fills the buffer owned by the simulation and swaps it with the middle
+ * one, the renderer never waits for the simulation or the other way
+ */
+static void
+publish_snapshot()
+{
+	Snapshot *snap = &snapshots[snapshot_write];
+
+	snap->count = body_count;
+	for(int i = 0; i < body_count; i++) {
+		snap->handle[i] = body_handle[i];
+		snap->position[i][0] = body_list[i].position[0];
+		snap->position[i][1] = body_list[i].position[1];
+		snap->half_size[i][0] = BODY_HALF(&body_list[i], 0);
+		snap->half_size[i][1] = BODY_HALF(&body_list[i], 1);
+		snap->state[i] = body_state(i);
+	}
+	snap->published = SDL_GetPerformanceCounter();
+
+	/* SDL_AtomicSet is not guaranteed to be a release on every platform */
+	SDL_MemoryBarrierRelease();
+	snapshot_write = SDL_AtomicSet(&snapshot_middle, snapshot_write | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+}
+
+/* 
+ * grabs the newest snapshot if there is one, keeping the positions of the
+ * one being replaced in render_prev so frames can be interpolated
+ */
+static int
+take_snapshot()
+{
+	Snapshot *curr = &snapshots[snapshot_read];
+
+	if(!(SDL_AtomicGet(&snapshot_middle) & SNAPSHOT_FRESH))
+		return 0;
+
+	render_prev.count = curr->count;
+	render_prev.published = curr->published;
+	memcpy(render_prev.handle, curr->handle, curr->count * sizeof(curr->handle[0]));
+	memcpy(render_prev.position, curr->position, curr->count * sizeof(curr->position[0]));
+
+	snapshot_read = SDL_AtomicSet(&snapshot_middle, snapshot_read) & ~SNAPSHOT_FRESH;
+	SDL_MemoryBarrierAcquire();
+	return 1;
+}
+
+static int
+body_state(int id)
+{
+	Body *b = &body_list[id];
+
+	if(BODY_STATIC(b))
+		return BODY_STATE_STATIC;
+	if(b->velocity[0] * b->velocity[0] + b->velocity[1] * b->velocity[1] < RESTING_SPEED * RESTING_SPEED)
+		return BODY_STATE_RESTING;
+	if(body_contacts[id] >= 3)
+		return BODY_STATE_CROWDED;
+	if(body_contacts[id] > 0)
+		return BODY_STATE_CONTACT;
+	return BODY_STATE_FREE;
+}
+
+/* 
+ * draws one publish interval behind the simulation, blending the last two
+ * snapshots by how far we are into the current interval. rects are culled
+ * against the viewport and batched per color, so a frame costs one draw
+ * call per body state instead of one per body.
+ */
+static void
+render_world()
+{
+	Snapshot *curr;
+	SDL_Rect viewport;
+	Float alpha = 1.0;
+
+	take_snapshot();
+	curr = &snapshots[snapshot_read];
+	SDL_RenderGetViewport(renderer, &viewport);
+
+	if(curr->published > render_prev.published) {
+		alpha = (Float)(SDL_GetPerformanceCounter() - curr->published) / (curr->published - render_prev.published);
+		if(alpha > 1.0)
+			alpha = 1.0;
+	}
+
+	for(int i = 0; i < BODY_STATE_COUNT; i++)
+		arrbuf_clear(&render_rects[i]);
+
+	for(int i = 0; i < curr->count; i++) {
+		Float position[2];
+		Float *half_size = curr->half_size[i];
+
+		if(i < render_prev.count && render_prev.handle[i] == curr->handle[i]) {
+			position[0] = render_prev.position[i][0] + (curr->position[i][0] - render_prev.position[i][0]) * alpha;
+			position[1] = render_prev.position[i][1] + (curr->position[i][1] - render_prev.position[i][1]) * alpha;
+		} else {
+			position[0] = curr->position[i][0];
+			position[1] = curr->position[i][1];
+		}
+
+		if(position[0] + half_size[0] < 0 || position[0] - half_size[0] > viewport.w ||
+		   position[1] + half_size[1] < 0 || position[1] - half_size[1] > viewport.h)
+			continue;
+
+		int state = RENDER_STATE_COLORS ? curr->state[i] : BODY_STATE_FREE;
+		*(SDL_Rect*)arrbuf_newptr(&render_rects[state], sizeof(SDL_Rect)) = (SDL_Rect){
+			.x = position[0] - half_size[0],
+			.y = position[1] - half_size[1],
+			.w = half_size[0] * 2.0,
+			.h = half_size[1] * 2.0
+		};
+	}
+
+	for(int i = 0; i < BODY_STATE_COUNT; i++) {
+		int count = arrbuf_length(&render_rects[i], sizeof(SDL_Rect));
+		if(!count)
+			continue;
+
+		SDL_SetRenderDrawColor(renderer, state_colors[i].r, state_colors[i].g, state_colors[i].b, state_colors[i].a);
+		SDL_RenderDrawRects(renderer, render_rects[i].data, count);
+	}
+}
+
+/* 
+ * returns the handle of the new body, or -1 when out of handles or the
+ * queue is full. the body shows up at the start of the next step.
+ */
+int
+body_spawn(const Body *b)
+{
+	Command command = { .type = COMMAND_SPAWN, .body = *b };
+
+	if((command.handle = alloc_handle()) < 0)
+		return -1;
+
+	if(!push_command(&command)) {
+		free_handle(command.handle);
+		return -1;
+	}
+	return command.handle;
+}
+
+int
+body_destroy(int handle)
+{
+	return push_command(&(Command){ .type = COMMAND_DESTROY, .handle = handle });
+}
+
+int
+body_impulse(int handle, Float x, Float y)
+{
+	return push_command(&(Command){ .type = COMMAND_IMPULSE, .handle = handle, .vector = { x, y } });
+}
+
+int
+body_set_velocity(int handle, Float x, Float y)
+{
+	return push_command(&(Command){ .type = COMMAND_SET_VELOCITY, .handle = handle, .vector = { x, y } });
+}
+
+/* pushes for the next step only, call it every step for a steady force */
+int
+body_force(int handle, Float x, Float y)
+{
+	return push_command(&(Command){ .type = COMMAND_FORCE, .handle = handle, .vector = { x, y } });
+}
+
+/* chunks around focus points (players, cameras...) are the ones simulated */
+int
+world_focus(int id, Float x, Float y)
+{
+	return push_command(&(Command){ .type = COMMAND_FOCUS, .handle = id, .vector = { x, y } });
+}
+
+int
+world_unfocus(int id)
+{
+	return push_command(&(Command){ .type = COMMAND_UNFOCUS, .handle = id });
+}
+
+/* solver passes per step, more is stiffer stacks for more time */
+int
+world_iterations(int iterations)
+{
+	return push_command(&(Command){ .type = COMMAND_ITERATIONS, .handle = iterations });
+}
+
+/* 
+ * bounded multi-producer ring, producers race for a position with a CAS
+ * on the tail and never wait: a full ring just returns 0.
+ */
+static int
+push_command(const Command *command)
+{
+	CommandSlot *slot;
+	unsigned int pos;
+
+	for(;;) {
+		pos = SDL_AtomicGet(&command_tail);
+		slot = &command_ring[pos & COMMAND_RING_MASK];
+
+		int diff = (int)((unsigned int)SDL_AtomicGet(&slot->sequence) - pos);
+		if(diff == 0) {
+			if(SDL_AtomicCAS(&command_tail, pos, pos + 1))
+				break;
+		} else if(diff < 0) {
+			return 0;
+		}
+	}
+
+	slot->command = *command;
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&slot->sequence, pos + 1);
+	return 1;
+}
+
+static void
+drain_commands()
+{
+	for(;;) {
+		CommandSlot *slot = &command_ring[command_head & COMMAND_RING_MASK];
+		Command command;
+
+		if((int)((unsigned int)SDL_AtomicGet(&slot->sequence) - (command_head + 1)) < 0)
+			break;
+
+		SDL_MemoryBarrierAcquire();
+		command = slot->command;
+		SDL_AtomicSet(&slot->sequence, command_head + COMMAND_RING_SIZE);
+		command_head++;
+
+		run_command(&command);
+	}
+}
+
+static void
+run_command(const Command *command)
+{
+	int slot, id;
+
+	switch(command->type) {
+	case COMMAND_SPAWN: {
+		Chunk *chunk = chunk_at(&command->body);
+
+		if(span_state(&command->body, chunk) == CHUNK_FROZEN)
+			store_body(chunk, &command->body, command->handle);
+		/* the handle body_spawn gave out goes stale with the new generation */
+		else if(add_body(&command->body, command->handle) < 0)
+			free_handle(command->handle);
+		return;
+	}
+	case COMMAND_FOCUS:
+	case COMMAND_UNFOCUS:
+		if(command->handle < 0 || command->handle >= MAX_FOCUS)
+			return;
+		focus_used[command->handle] = command->type == COMMAND_FOCUS;
+		focus[command->handle][0] = command->vector[0];
+		focus[command->handle][1] = command->vector[1];
+		return;
+	case COMMAND_ITERATIONS:
+		if(command->handle >= 1 && command->handle <= SOLVER_ITERATIONS_MAX)
+			solver_iterations = command->handle;
+		return;
+	}
+
+	/* stale handle, or one whose body was never added */
+	if((slot = handle_slot(command->handle)) < 0)
+		return;
+	if((id = handle_body[slot]) < 0) {
+		if(handle_chunk[slot] >= 0)
+			run_stored_command(command, slot);
+		return;
+	}
+
+	switch(command->type) {
+	case COMMAND_DESTROY:
+		remove_body(id);
+		free_handle(command->handle);
+		break;
+	case COMMAND_IMPULSE:
+		body_list[id].velocity[0] += command->vector[0] * body_list[id].inv_mass;
+		body_list[id].velocity[1] += command->vector[1] * body_list[id].inv_mass;
+		break;
+	case COMMAND_SET_VELOCITY:
+		body_list[id].velocity[0] = command->vector[0];
+		body_list[id].velocity[1] = command->vector[1];
+		break;
+	case COMMAND_FORCE: {
+		Force *force = arrbuf_newptr(&body_forces, sizeof(Force));
+
+		force->handle = command->handle;
+		force->force[0] = command->vector[0];
+		force->force[1] = command->vector[1];
+		break;
+	}
+	}
+}
+
+/* 
+ * the body sits frozen in a chunk, loaded back from disk if needed. a
+ * frozen body is not stepped, so a force on it is dropped like it would
+ * be at the end of a step.
+ */
+static void
+run_stored_command(const Command *command, int slot)
+{
+	Chunk *chunk = &chunk_table[handle_chunk[slot]];
+	StoredBody *stored;
+	int count, i;
+
+	if(command->type == COMMAND_FORCE || !make_resident(chunk))
+		return;
+
+	stored = chunk->stored.data;
+	count = arrbuf_length(&chunk->stored, sizeof(StoredBody));
+	for(i = 0; i < count && stored[i].handle != command->handle; i++)
+		;
+	if(i == count)
+		return;
+
+	switch(command->type) {
+	case COMMAND_DESTROY:
+		stored[i] = stored[count - 1];
+		arrbuf_poptop(&chunk->stored, sizeof(StoredBody));
+		handle_chunk[slot] = -1;
+		free_handle(command->handle);
+		break;
+	case COMMAND_IMPULSE:
+		stored[i].body.velocity[0] += command->vector[0] * stored[i].body.inv_mass;
+		stored[i].body.velocity[1] += command->vector[1] * stored[i].body.inv_mass;
+		break;
+	case COMMAND_SET_VELOCITY:
+		stored[i].body.velocity[0] = command->vector[0];
+		stored[i].body.velocity[1] = command->vector[1];
+		break;
+	}
+}
+
+static int
+alloc_handle()
+{
+	int words = LENGTH(handle_bitmap), start = SDL_AtomicGet(&handle_hint);
+
+	for(int n = 0; n < words; n++) {
+		int i = (start + n) % words;
+
+		for(;;) {
+			unsigned int word = SDL_AtomicGet(&handle_bitmap[i]);
+			unsigned int free_bit = ~word & (word + 1);
+			int bit = 0;
+
+			if(!free_bit)
+				break;
+			while(!(free_bit & (1u << bit)))
+				bit++;
+
+			if(SDL_AtomicCAS(&handle_bitmap[i], word, word | free_bit)) {
+				if(i != start)
+					SDL_AtomicSet(&handle_hint, i);
+				return MAKE_HANDLE(i * 32 + bit, handle_generation[i * 32 + bit]);
+			}
+		}
+	}
+	return -1;
+}
+
+static void
+free_handle(int handle)
+{
+	int index = HANDLE_INDEX(handle);
+	SDL_atomic_t *word = &handle_bitmap[index / 32];
+	unsigned int value;
+
+	handle_generation[index] = (HANDLE_GENERATION(handle) + 1) & HANDLE_GENERATION_MASK;
+	do {
+		value = SDL_AtomicGet(word);
+	} while(!SDL_AtomicCAS(word, value, value & ~(1u << (index % 32))));
+	SDL_AtomicSet(&handle_hint, index / 32);
+}
+
+/* claims a known handle, for bodies coming from another shard */
+static void
+mark_handle(int handle)
+{
+	int index = HANDLE_INDEX(handle);
+	SDL_atomic_t *word = &handle_bitmap[index / 32];
+	unsigned int value;
+
+	handle_generation[index] = HANDLE_GENERATION(handle);
+	do {
+		value = SDL_AtomicGet(word);
+	} while(!SDL_AtomicCAS(word, value, value | (1u << (index % 32))));
+}
+
+/* the slot of a handle still in use, -1 for garbage and freed handles */
+static int
+handle_slot(int handle)
+{
+	int index = HANDLE_INDEX(handle);
+
+	if(handle < 0 || index >= N_HANDLE || handle_generation[index] != HANDLE_GENERATION(handle))
+		return -1;
+	return index;
+}
+
+static int
+add_body(const Body *b, int handle)
+{
+	Chunk *chunk;
+	int id;
+
+	if(body_count >= N_BODY)
+		return -1;
+
+	/* before the body counts, the lookup may rebuild the table */
+	chunk = chunk_at(b);
+	id = body_count++;
+	body_list[id] = *b;
+	body_handle[id] = handle;
+	body_chunk[id] = chunk - chunk_table;
+	body_rate[id] = 0;
+	body_ghost[id] = 0;
+	if(handle >= 0) {
+		handle_body[HANDLE_INDEX(handle)] = id;
+		handle_chunk[HANDLE_INDEX(handle)] = -1;
+	}
+	return id;
+}
+
+/* swaps the last body into id, the handle of the removed one is unmapped */
+static void
+remove_body(int id)
+{
+	if(body_handle[id] >= 0)
+		handle_body[HANDLE_INDEX(body_handle[id])] = -1;
+	pairs_dirty = 1;
+	body_count--;
+	if(id != body_count) {
+		body_list[id] = body_list[body_count];
+		body_handle[id] = body_handle[body_count];
+		body_chunk[id] = body_chunk[body_count];
+		body_rate[id] = body_rate[body_count];
+		body_ghost[id] = body_ghost[body_count];
+		if(body_handle[id] >= 0)
+			handle_body[HANDLE_INDEX(body_handle[id])] = id;
+	}
+}
+
+/* with create set a missing chunk is added frozen, possibly moving all of them */
+static Chunk *
+find_chunk(int x, int y, int create)
+{
+	Chunk *tombstone = NULL;
+	unsigned int i;
+
+	if(!chunk_table) {
+		if(!create)
+			return NULL;
+		rehash_chunks();
+	}
+
+	for(i = hash_pos(x, y, 0) & chunk_table_mask;; i = (i + 1) & chunk_table_mask) {
+		Chunk *chunk = &chunk_table[i];
+
+		if(!chunk->used) {
+			if(!create)
+				return NULL;
+			if((chunk_count + chunk_tombstones + 1) * 2 > chunk_table_mask + 1) {
+				rehash_chunks();
+				return find_chunk(x, y, create);
+			}
+
+			if(tombstone) {
+				chunk = tombstone;
+				chunk_tombstones--;
+			}
+			memset(chunk, 0, sizeof(*chunk));
+			chunk_count++;
+			chunk->used = 1;
+			chunk->x = x;
+			chunk->y = y;
+			chunk->state = CHUNK_FROZEN;
+			arrbuf_init(&chunk->stored);
+			arrbuf_init(&chunk->links);
+			return chunk;
+		}
+
+		if(chunk->deleted) {
+			if(!tombstone)
+				tombstone = chunk;
+			continue;
+		}
+
+		if(chunk->x == x && chunk->y == y)
+			return chunk;
+	}
+}
+
+/* only for chunks nothing points to: not resident, not spilled, no bodies or links */
+static void
+release_chunk(Chunk *chunk)
+{
+	arrbuf_free(&chunk->stored);
+	arrbuf_free(&chunk->links);
+	chunk->deleted = 1;
+	chunk_count--;
+	chunk_tombstones++;
+}
+
+/* 
+ * drops the tombstones, doubling the table if live chunks alone would
+ * fill half of it, and fixes every index into it
+ */
+static void
+rehash_chunks()
+{
+	Chunk *old = chunk_table;
+	unsigned int old_size = chunk_table ? chunk_table_mask + 1 : 0;
+	unsigned int size = old_size ? old_size : CHUNK_TABLE_MIN;
+	int *moved, *resident = resident_chunks.data;
+	int count = arrbuf_length(&resident_chunks, sizeof(int));
+
+	while((unsigned int)(chunk_count + 1) * 4 > size)
+		size *= 2;
+
+	chunk_table = emalloc(size * sizeof(Chunk));
+	chunk_table_mask = size - 1;
+	memset(chunk_table, 0, size * sizeof(Chunk));
+	chunk_tombstones = 0;
+	if(!old)
+		return;
+
+	moved = emalloc(old_size * sizeof(int));
+	for(unsigned int i = 0; i < old_size; i++) {
+		unsigned int j;
+
+		if(!old[i].used || old[i].deleted)
+			continue;
+		for(j = hash_pos(old[i].x, old[i].y, 0) & chunk_table_mask; chunk_table[j].used; j = (j + 1) & chunk_table_mask)
+			;
+		chunk_table[j] = old[i];
+		moved[i] = j;
+	}
+
+	for(int i = 0; i < body_count; i++)
+		body_chunk[i] = moved[body_chunk[i]];
+	for(int i = 0; i < count; i++)
+		resident[i] = moved[resident[i]];
+	for(int i = 0; i < N_HANDLE; i++)
+		if(handle_chunk[i] >= 0)
+			handle_chunk[i] = moved[handle_chunk[i]];
+	efree(moved);
+	efree(old);
+}
+
+static Chunk *
+chunk_at(const Body *b)
+{
+	return find_chunk(FLOOR(b->position[0] / CHUNK_SIZE), FLOOR(b->position[1] / CHUNK_SIZE), 1);
+}
+
+/* every chunk a body overlaps, not only the one holding its center */
+static void
+chunk_span(const Body *b, int min[2], int max[2])
+{
+	min[0] = FLOOR((b->position[0] - BODY_HALF(b, 0)) / CHUNK_SIZE);
+	min[1] = FLOOR((b->position[1] - BODY_HALF(b, 1)) / CHUNK_SIZE);
+	max[0] = FLOOR((b->position[0] + BODY_HALF(b, 0)) / CHUNK_SIZE);
+	max[1] = FLOOR((b->position[1] + BODY_HALF(b, 1)) / CHUNK_SIZE);
+}
+
+/* 
+ * the state a body is simulated at. a static body is a floor or a wall
+ * for every chunk it overlaps, so it takes the most awake of them.
+ */
+static int
+span_state(const Body *b, const Chunk *home)
+{
+	int min[2], max[2], state = home->state;
+
+	if(!BODY_STATIC(b) || state != CHUNK_FROZEN)
+		return state;
+
+	chunk_span(b, min, max);
+	for(int x = min[0]; x <= max[0]; x++)
+	for(int y = min[1]; y <= max[1]; y++) {
+		Chunk *chunk = find_chunk(x, y, 0);
+
+		if(chunk && chunk->state > state)
+			state = chunk->state;
+	}
+	return state;
+}
+
+/* 
+ * brings the stored bodies of a chunk back from disk if they were spilled.
+ * a spill that cannot be read is reported and the chunk stays frozen and
+ * out of memory, to be tried again next time it is needed.
+ */
+static int
+make_resident(Chunk *chunk)
+{
+	char path[64];
+	char *data;
+	size_t size;
+
+	chunk->frozen_steps = 0;
+	if(chunk->resident)
+		return 1;
+
+	if(chunk->on_disk) {
+		snprintf(path, sizeof(path), CHUNK_DIR "/%d_%d.chunk", chunk->x, chunk->y);
+		if(!(data = read_file(path, &size))) {
+			fprintf(stderr, "could not read %s, chunk stays frozen\n", path);
+			return 0;
+		}
+
+		memcpy(arrbuf_newptr(&chunk->stored, size), data, size);
+		efree(data);
+		remove(path);
+		chunk->on_disk = 0;
+	}
+
+	chunk->resident = 1;
+	chunk->next_state = CHUNK_FROZEN;
+	arrbuf_insert(&resident_chunks, sizeof(int), &(int){ chunk - chunk_table });
+	return 1;
+}
+
+/* when the spill can not be read the body waits in memory, ahead of it */
+static void
+store_body(Chunk *chunk, const Body *b, int handle)
+{
+	make_resident(chunk);
+	arrbuf_insert(&chunk->stored, sizeof(StoredBody), &(StoredBody){ .body = *b, .handle = handle });
+	if(handle >= 0) {
+		handle_body[HANDLE_INDEX(handle)] = -1;
+		handle_chunk[HANDLE_INDEX(handle)] = chunk - chunk_table;
+	}
+	if(!BODY_STATIC(b))
+		return;
+
+	/* after this the chunk may have moved, creating others can rebuild the table */
+	int home[2] = { chunk->x, chunk->y }, min[2], max[2];
+
+	chunk_span(b, min, max);
+	for(int x = min[0]; x <= max[0]; x++)
+	for(int y = min[1]; y <= max[1]; y++) {
+		Chunk *other;
+		int (*links)[2], count, i;
+
+		if(x == home[0] && y == home[1])
+			continue;
+		other = find_chunk(x, y, 1);
+		links = other->links.data;
+		count = arrbuf_length(&other->links, sizeof(int[2]));
+		for(i = 0; i < count && (links[i][0] != home[0] || links[i][1] != home[1]); i++)
+			;
+		if(i == count)
+			arrbuf_insert(&other->links, sizeof(int[2]), home);
+	}
+}
+
+static void
+freeze_body(int id)
+{
+	store_body(&chunk_table[body_chunk[id]], &body_list[id], body_handle[id]);
+	remove_body(id);
+}
+
+static void
+stream_in_chunk(Chunk *chunk)
+{
+	StoredBody *stored = chunk->stored.data;
+	int count = arrbuf_length(&chunk->stored, sizeof(StoredBody));
+	int i;
+
+	/* whatever does not fit waits for the next update */
+	for(i = 0; i < count && body_count < N_BODY; i++)
+		add_body(&stored[i].body, stored[i].handle);
+
+	arrbuf_remove(&chunk->stored, i * sizeof(StoredBody), 0);
+}
+
+/* 
+ * wakes the static bodies other chunks hold that reach into this one,
+ * links whose chunk could not be loaded or bodies that did not fit are
+ * kept for the next update
+ */
+static void
+stream_in_links(Chunk *chunk)
+{
+	int (*links)[2] = chunk->links.data;
+	int count = arrbuf_length(&chunk->links, sizeof(int[2]));
+
+	for(int i = 0; i < count; i++) {
+		Chunk *home = find_chunk(links[i][0], links[i][1], 0);
+		StoredBody *stored;
+		int left = 0, stored_count;
+
+		if(home && !home->resident) {
+			left = 1;
+		} else if(home) {
+			stored = home->stored.data;
+			stored_count = arrbuf_length(&home->stored, sizeof(StoredBody));
+			for(int j = 0; j < stored_count; j++) {
+				int min[2], max[2];
+
+				chunk_span(&stored[j].body, min, max);
+				if(!BODY_STATIC(&stored[j].body) || chunk->x < min[0] || chunk->x > max[0] ||
+				   chunk->y < min[1] || chunk->y > max[1])
+					continue;
+				if(add_body(&stored[j].body, stored[j].handle) < 0) {
+					left = 1;
+					break;
+				}
+				stored[j--] = stored[--stored_count];
+				arrbuf_poptop(&home->stored, sizeof(StoredBody));
+			}
+		}
+
+		if(left)
+			continue;
+		count--;
+		links[i][0] = links[count][0];
+		links[i][1] = links[count][1];
+		arrbuf_poptop(&chunk->links, sizeof(int[2]));
+		i--;
+	}
+}
+
+static int
+spill_chunk(Chunk *chunk)
+{
+	char path[64];
+	FILE *fp;
+
+	mkdir(CHUNK_DIR, 0755);
+	snprintf(path, sizeof(path), CHUNK_DIR "/%d_%d.chunk", chunk->x, chunk->y);
+	if(!(fp = fopen(path, "wb")))
+		return 0;
+
+	/* a short write keeps the bodies in memory, the spill is retried later */
+	if(fwrite(chunk->stored.data, 1, chunk->stored.size, fp) != chunk->stored.size) {
+		fclose(fp);
+		remove(path);
+		return 0;
+	}
+	if(fclose(fp) != 0) {
+		remove(path);
+		return 0;
+	}
+
+	arrbuf_free(&chunk->stored);
+	arrbuf_init(&chunk->stored);
+	chunk->on_disk = 1;
+	chunk->resident = 0;
+	return 1;
+}
+
+/* 
+ * recomputes chunk states from the focus points, moving bodies in and out
+ * of body_list when a chunk wakes up or freezes. only resident chunks are
+ * visited, so the cost does not depend on how big the world is.
+ */
+static void
+update_chunks()
+{
+	int count, *resident;
+
+	count = arrbuf_length(&resident_chunks, sizeof(int));
+	resident = resident_chunks.data;
+	for(int i = 0; i < count; i++)
+		chunk_table[resident[i]].next_state = CHUNK_FROZEN;
+
+	for(int f = 0; f < MAX_FOCUS; f++) {
+		if(!focus_used[f])
+			continue;
+
+		int cx = FLOOR(focus[f][0] / CHUNK_SIZE);
+		int cy = FLOOR(focus[f][1] / CHUNK_SIZE);
+		for(int dx = -CHUNK_LOW_RATE_RADIUS; dx <= CHUNK_LOW_RATE_RADIUS; dx++)
+		for(int dy = -CHUNK_LOW_RATE_RADIUS; dy <= CHUNK_LOW_RATE_RADIUS; dy++) {
+			Chunk *chunk = find_chunk(cx + dx, cy + dy, 1);
+			int dist = abs(dx) > abs(dy) ? abs(dx) : abs(dy);
+			int state = dist <= CHUNK_ACTIVE_RADIUS ? CHUNK_ACTIVE : CHUNK_LOW_RATE;
+
+			if(!make_resident(chunk))
+				continue;
+			if(state > chunk->next_state)
+				chunk->next_state = state;
+
+			/* the chunks holding its static neighbors must be loaded to wake them */
+			int (*links)[2] = chunk->links.data;
+			for(int i = 0; i < (int)arrbuf_length(&chunk->links, sizeof(int[2])); i++) {
+				Chunk *home = find_chunk(links[i][0], links[i][1], 0);
+
+				if(home)
+					make_resident(home);
+			}
+		}
+	}
+
+	count = arrbuf_length(&resident_chunks, sizeof(int));
+	resident = resident_chunks.data;
+	for(int i = 0; i < count; i++) {
+		Chunk *chunk = &chunk_table[resident[i]];
+
+		chunk->state = chunk->next_state;
+		if(chunk->state != CHUNK_FROZEN && chunk->stored.size)
+			stream_in_chunk(chunk);
+	}
+	for(int i = 0; i < count; i++) {
+		Chunk *chunk = &chunk_table[resident[i]];
+
+		if(chunk->state != CHUNK_FROZEN && chunk->links.size)
+			stream_in_links(chunk);
+	}
+
+	for(int i = 0; i < body_count; i++)
+		if(span_state(&body_list[i], &chunk_table[body_chunk[i]]) == CHUNK_FROZEN)
+			freeze_body(i--);
+
+	chunk_stats[CHUNK_ACTIVE] = chunk_stats[CHUNK_LOW_RATE] = chunk_stats[CHUNK_FROZEN] = 0;
+	for(int i = 0; i < count; i++) {
+		Chunk *chunk = &chunk_table[resident[i]];
+
+		chunk_stats[chunk->state]++;
+		chunk->border = 0;
+		if(chunk->state == CHUNK_LOW_RATE) {
+			/* low rate bodies next to active chunks act as walls between their steps */
+			for(int dx = -1; dx <= 1; dx++)
+			for(int dy = -1; dy <= 1; dy++) {
+				Chunk *other = find_chunk(chunk->x + dx, chunk->y + dy, 0);
+				if(other && other->state == CHUNK_ACTIVE)
+					chunk->border = 1;
+			}
+			continue;
+		}
+
+		if(chunk->state != CHUNK_FROZEN)
+			continue;
+
+		chunk->frozen_steps += CHUNK_LOW_RATE_STEPS;
+		if(chunk->stored.size == 0 && chunk->links.size == 0)
+			release_chunk(chunk);
+		else if(chunk->stored.size == 0)
+			chunk->resident = 0;
+		else if(chunk->frozen_steps < CHUNK_SPILL_STEPS || !spill_chunk(chunk))
+			continue;
+
+		resident[i--] = resident[--count];
+		arrbuf_poptop(&resident_chunks, sizeof(int));
+	}
+}
+
+/* 
+ * moves bodies to the chunk they are in now and decides who is stepped:
+ * bodies that wandered into a frozen chunk get frozen with it.
+ */
+static void
+assign_chunks(int low_rate_tick)
+{
+	int rate, state;
+
+	if(!chunk_streaming) {
+		for(int i = 0; i < body_count; i++) {
+			pairs_dirty |= i < pair_bodies && body_rate[i] != !body_ghost[i];
+			body_rate[i] = !body_ghost[i];
+		}
+		return;
+	}
+
+	for(int i = 0; i < body_count; i++) {
+		Body *b = &body_list[i];
+		Chunk *chunk = &chunk_table[body_chunk[i]];
+		int x = FLOOR(b->position[0] / CHUNK_SIZE);
+		int y = FLOOR(b->position[1] / CHUNK_SIZE);
+
+		if(chunk->x != x || chunk->y != y) {
+			chunk = find_chunk(x, y, 1);
+			body_chunk[i] = chunk - chunk_table;
+		}
+
+		state = span_state(b, chunk);
+		if(state == CHUNK_FROZEN) {
+			freeze_body(i--);
+			continue;
+		}
+
+		rate = state == CHUNK_ACTIVE ? 1 : low_rate_tick ? CHUNK_LOW_RATE_STEPS : 0;
+		pairs_dirty |= i < pair_bodies && body_rate[i] != rate;
+		body_rate[i] = rate;
+	}
+}
+
+/* 
+ * runs the demo scene split over count worker processes for the given
+ * number of steps. the scene gets its handles here, before the fork, so
+ * handles stay unique when bodies change shards.
+ */
+static int
+run_shards(int count, int steps)
+{
+	ShardShared *shared;
+	pthread_barrierattr_t attr;
+	ArrayBuffer scene;
+	Uint64 start, end;
+	int total = 0, status, failed = 0, expected;
+
+	if(count < 1 || count > SHARD_MAX)
+		die("shard count must be between 1 and %d\n", SHARD_MAX);
+
+	shared = mmap(NULL, sizeof(ShardShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(shared == MAP_FAILED)
+		die("could not map shard memory\n");
+	memset(shared, 0, sizeof(ShardShared));
+	shared->count = count;
+
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&shared->barrier, &attr, count);
+	pthread_barrierattr_destroy(&attr);
+
+	arrbuf_init(&scene);
+	*(Body*)arrbuf_newptr(&scene, sizeof(Body)) = (Body){
+		.position = { count * SHARD_WIDTH * 0.5, 600 },
+		.half_size = { HALF_SIZE(count * SHARD_WIDTH * 0.5), HALF_SIZE(10) },
+		.material = MATERIAL_STONE
+	};
+	for(int i = 0; i < N_BODY / 2; i++) {
+		*(Body*)arrbuf_newptr(&scene, sizeof(Body)) = (Body){
+			.position = { RAND(0, count * SHARD_WIDTH), RAND(0, 500) },
+			.velocity = { RAND(-200.0, 200.0), 0 },
+			.half_size = { HALF_SIZE(RAND(2, 5)), HALF_SIZE(RAND(2, 5)) },
+			.inv_mass = 1 / RAND(5, 10),
+			.material = rand() % MATERIAL_COUNT,
+		};
+	}
+
+	/* exit and not _exit, so ALLOC_TRACKING reports every worker */
+	fflush(stdout);
+	start = SDL_GetPerformanceCounter();
+	for(int i = 0; i < count; i++) {
+		pid_t pid = fork();
+
+		if(pid < 0)
+			die("fork failed\n");
+		if(pid == 0) {
+			shard_worker(shared, i, scene.data, arrbuf_length(&scene, sizeof(Body)), steps);
+			exit(EXIT_SUCCESS);
+		}
+	}
+	for(int i = 0; i < count; i++) {
+		wait(&status);
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+	}
+	end = SDL_GetPerformanceCounter();
+
+	for(int i = 0; i < count; i++) {
+		printf("SHARD %d: %d bodies\n", i, SDL_AtomicGet(&shared->bodies[i]));
+		total += SDL_AtomicGet(&shared->bodies[i]);
+	}
+	/* the floor is the only static body of the scene */
+	expected = arrbuf_length(&scene, sizeof(Body)) - 1;
+	printf("SHARDS: %d | STEPS: %d | BODIES: %d/%d | TIME: %f ms/step\n",
+			count, steps, total, expected,
+			1000.0 * (end - start) / SDL_GetPerformanceFrequency() / steps);
+	if(failed)
+		printf("a shard worker failed\n");
+	else if(total != expected)
+		printf("%d bodies lost between shards\n", expected - total);
+
+	arrbuf_free(&scene);
+	pthread_barrier_destroy(&shared->barrier);
+	munmap(shared, sizeof(ShardShared));
+	return failed || total != expected ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void
+shard_worker(ShardShared *shared, int shard, const Body *scene, int scene_count, int steps)
+{
+	Float x0 = shard * SHARD_WIDTH, x1 = x0 + SHARD_WIDTH;
+	int owned = 0;
+
+	init_world();
+	chunk_streaming = 0;
+
+	/* dynamic bodies belong to one shard, static ones are copied to all they touch */
+	for(int i = 0; i < scene_count; i++) {
+		const Body *b = &scene[i];
+
+		if(BODY_STATIC(b)) {
+			if(b->position[0] + BODY_HALF(b, 0) < x0 || b->position[0] - BODY_HALF(b, 0) >= x1)
+				continue;
+		} else if(b->position[0] < x0 || b->position[0] >= x1) {
+			continue;
+		}
+
+		mark_handle(i);
+		add_body(b, i);
+	}
+
+	for(int i = 0; i < steps; i++) {
+		step_world();
+		shard_exchange(shared, shard);
+	}
+
+	for(int i = 0; i < body_count; i++)
+		owned += !body_ghost[i] && !BODY_STATIC(&body_list[i]);
+	SDL_AtomicSet(&shared->bodies[shard], owned);
+}
+
+/* 
+ * after a step every shard sends its border bodies as ghosts and hands
+ * off the ones that left its strip, then waits for everybody before
+ * reading what the neighbors sent. the first and last shards keep bodies
+ * that leave the world on their outer side.
+ */
+static void
+shard_exchange(ShardShared *shared, int shard)
+{
+	Float x0 = shard * SHARD_WIDTH, x1 = x0 + SHARD_WIDTH;
+	ShardRing *left = shard > 0 ? &shared->rings[shard - 1][1] : NULL;
+	ShardRing *right = shard < shared->count - 1 ? &shared->rings[shard + 1][0] : NULL;
+
+	for(int i = 0; i < body_count; i++)
+		if(body_ghost[i])
+			remove_body(i--);
+
+	for(int i = 0; i < body_count; i++) {
+		Body *b = &body_list[i];
+		int handle = body_handle[i];
 
-#define GRID_BITS 18
-#define GRID_BUFFER_SIZE (1 << GRID_BITS)
-#define GRID_BUFFER_MASK (GRID_BUFFER_SIZE - 1)
-#define GRID_TILE_SIZE 16
+		if(BODY_STATIC(b))
+			continue;
 
-#define UINTMAX_BITS (sizeof(uintmax_t) * 8)
+		/* if the neighbor has no room the body stays here one more step */
+		if(left && b->position[0] < x0 && shard_push(left, b, handle)) {
+			remove_body(i--);
+			free_handle(handle);
+			continue;
+		}
+		if(right && b->position[0] >= x1 && shard_push(right, b, handle)) {
+			remove_body(i--);
+			free_handle(handle);
+			continue;
+		}
 
-typedef float Float;
-typedef struct {
-	Float position[2];
-	Float velocity[2];
-	Float acceleration[2];
-	Float half_size[2];
-	
-	Float mass;
-	Float restitution;
-	int is_static;
-} Body;
+		if(left && b->position[0] - BODY_HALF(b, 0) < x0 + SHARD_HALO)
+			shard_push(left, b, -1);
+		if(right && b->position[0] + BODY_HALF(b, 0) > x1 - SHARD_HALO)
+			shard_push(right, b, -1);
+	}
 
-typedef struct {
-	int next, prev;
-	Body *body;
-} BodyNodeList;
+	pthread_barrier_wait(&shared->barrier);
 
-#define RAND_FLOAT (rand() / (Float)RAND_MAX)
-#define RAND(MIN, MAX) (RAND_FLOAT * (MAX - MIN) + MIN)
+	for(int side = 0; side < 2; side++) {
+		ShardRing *ring = &shared->rings[shard][side];
+		int tail = SDL_AtomicGet(&ring->tail);
+		int head = SDL_AtomicGet(&ring->head);
 
-static inline uint_fast32_t hash_pos_comp(uint_fast32_t x)
-{
-	x &= (GRID_BUFFER_MASK);
-	return (x * 162013) & (GRID_BUFFER_MASK);
+		SDL_MemoryBarrierAcquire();
+		for(; tail != head; tail++) {
+			StoredBody *item = &ring->items[tail & SHARD_RING_MASK];
+			int id;
+
+			if(item->handle >= 0)
+				mark_handle(item->handle);
+			if((id = add_body(&item->body, item->handle)) >= 0 && item->handle < 0)
+				body_ghost[id] = 1;
+		}
+		SDL_AtomicSet(&ring->tail, tail);
+	}
+
+	/* nobody writes into a ring before its owner is done reading it */
+	pthread_barrier_wait(&shared->barrier);
 }
 
-static inline uint_fast32_t hash_pos(uint_fast32_t x, uint_fast32_t y)
+static int
+shard_push(ShardRing *ring, const Body *b, int handle)
 {
-	return hash_pos_comp(x + hash_pos_comp(y));
+	int head = SDL_AtomicGet(&ring->head);
+
+	if(head - SDL_AtomicGet(&ring->tail) >= SHARD_RING_SIZE)
+		return 0;
+
+	ring->items[head & SHARD_RING_MASK] = (StoredBody){ .body = *b, .handle = handle };
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&ring->head, head + 1);
+	return 1;
 }
 
-static void solve_body(Body *body, Float delta);
-static void solve_body_grid_list(int grid_list, int other_grid, Float delta);
-static void solve_body_grid_list_static(int grid_list, int other_grid, Float delta);
-static void solve_body_grid(int body_node, int other_grid, Float delta);
-static void solve_body_grid_static(int body_node, int other_grid, Float delta);
-static void update_body(Body *body, Float delta);
-static void render_body(Body *body);
+/* 
+ * differential check of the grid against the all-pairs reference: every
+ * step the touching pairs of the batch the step is about to solve, rebuilt
+ * or reused, are compared with the reference from the same state, pairs
+ * the grid misses or hands over twice are reported. exits with failure if
+ * anything differs.
+ */
+static int
+run_verify(unsigned int seed, int count, int steps)
+{
+	ArrayBuffer reference, grid, scratch[PAIR_BATCHES];
+	double reference_time = 0, grid_time = 0;
+	long pairs = 0, missed = 0, duplicate = 0, extra = 0;
+
+	init_world();
+	chunk_streaming = 0;
+	srand(seed);
+
+	/* walls, a few big and static bodies to cover every grid level */
+	add_body(&(Body){ .position = { 400, 590 }, .half_size = { HALF_SIZE(400), HALF_SIZE(10) }, .material = MATERIAL_STONE }, -1);
+	add_body(&(Body){ .position = { 5,   300 }, .half_size = { HALF_SIZE(10), HALF_SIZE(300) }, .material = MATERIAL_STONE }, -1);
+	add_body(&(Body){ .position = { 795, 300 }, .half_size = { HALF_SIZE(10), HALF_SIZE(300) }, .material = MATERIAL_STONE }, -1);
+	for(int i = 0; i < count && body_count < N_BODY; i++)
+		add_verify_body(i);
+
+	arrbuf_init(&reference);
+	arrbuf_init(&grid);
+	for(int i = 0; i < PAIR_BATCHES; i++)
+		arrbuf_init(&scratch[i]);
+
+	for(int step = 0; step < steps; step++) {
+		Uint64 start, middle, end;
+
+		arrbuf_clear(&reference);
+		arrbuf_clear(&grid);
+
+		/* the pair update is the only real work before the solver */
+		start = SDL_GetPerformanceCounter();
+		begin_step();
+		record_pairs(&grid);
+
+		/* the reference goes through the batches too, keep them aside */
+		middle = SDL_GetPerformanceCounter();
+		for(int i = 0; i < PAIR_BATCHES; i++) {
+			ArrayBuffer swap = pair_batch[i];
+
+			pair_batch[i] = scratch[i];
+			scratch[i] = swap;
+			arrbuf_clear(&pair_batch[i]);
+		}
+		for(int i = 0; i < body_count; i++)
+			solve_body(&body_list[i], PHYSICS_TIME);
+		record_pairs(&reference);
+		for(int i = 0; i < PAIR_BATCHES; i++) {
+			ArrayBuffer swap = pair_batch[i];
 
-static BodyNodeList *blist(int id);
-static void          add_body_list(int *body_list, Body *);
-static void          clear_lists();
-static void          calculate_grid();
-static void          calculate_grid_body(Body *);
+			pair_batch[i] = scratch[i];
+			scratch[i] = swap;
+		}
+		end = SDL_GetPerformanceCounter();
 
-static void test_and_solve(Body *body, Body *body2, Float delta);
-static void test_and_solve_static(Body *body, Body *body2, Float delta);
+		grid_time += (double)(middle - start) / SDL_GetPerformanceFrequency();
+		reference_time += (double)(end - middle) / SDL_GetPerformanceFrequency();
 
-static SDL_Window *window;
-static SDL_Renderer *renderer;
-static Body body_list[N_BODY];
-static ArrayBuffer body_node_buffer, body_already_checked_buffer;
-static int body_count;
+		uint64_t *a = reference.data, *b = grid.data;
+		size_t na = arrbuf_length(&reference, sizeof(uint64_t)), nb = arrbuf_length(&grid, sizeof(uint64_t));
+		qsort(a, na, sizeof(uint64_t), compare_pair);
+		qsort(b, nb, sizeof(uint64_t), compare_pair);
 
-static int grid_list[GRID_BUFFER_SIZE];
-static int static_grid_list[GRID_BUFFER_SIZE];
+		for(size_t i = 1; i < nb; i++) {
+			if(b[i] != b[i - 1])
+				continue;
+			if(duplicate++ < 10)
+				printf("step %d: pair %d %d solved twice\n", step, (int)(b[i] >> 32), (int)(b[i] & 0xFFFFFFFF));
+		}
 
-static int max_object_count = 0;
-static int object_count = 0;
-static int object_sum = 0;
-static int iterations = 0;
-static int count_20 = 0;
+		size_t i = 0, j = 0;
+		while(i < na || j < nb) {
+			if(j < nb && j > 0 && b[j] == b[j - 1]) {
+				j++;
+			} else if(j >= nb || (i < na && a[i] < b[j])) {
+				if(missed++ < 10)
+					printf("step %d: pair %d %d missed\n", step, (int)(a[i] >> 32), (int)(a[i] & 0xFFFFFFFF));
+				i++;
+			} else if(i >= na || b[j] < a[i]) {
+				extra++;
+				j++;
+			} else {
+				i++;
+				j++;
+			}
+		}
+		pairs += na;
 
-static int already_checked(int body1_id, int body2_id)
-{
-	unsigned int element_size = (body_count + UINTMAX_BITS) / UINTMAX_BITS;
+		finish_step();
+
+		/* a few late bodies so pairing them without a rebuild is checked too */
+		if(step % 4 == 0 && body_count < N_BODY)
+			add_verify_body(step + 1);
+	}
+
+	arrbuf_free(&reference);
+	arrbuf_free(&grid);
+	for(int i = 0; i < PAIR_BATCHES; i++)
+		arrbuf_free(&scratch[i]);
+
+	printf("VERIFY: seed %u | bodies %d | steps %d | pairs %ld | missed %ld | duplicate %ld | extra %ld\n",
+			seed, body_count, steps, pairs, missed, duplicate, extra);
+	printf("REFERENCE: %f ms/step | GRID: %f ms/step | SPEEDUP: %fx\n",
+			1000.0 * reference_time / steps, 1000.0 * grid_time / steps,
+			grid_time > 0 ? reference_time / grid_time : 0);
 
-	unsigned int body1_check_offset = body1_id * element_size;
-	unsigned int body2_element = body2_id / UINTMAX_BITS;
-	unsigned int body2_bit = body2_id % UINTMAX_BITS;
-	uintmax_t element = *((uintmax_t*)body_already_checked_buffer.data) + body1_check_offset + body2_element;
+	return missed || duplicate || extra ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-	return (element & (1 << body2_bit)) != 0;
+static void
+add_verify_body(int i)
+{
+	Float size = i % 64 == 0 ? RAND(10, 40) : RAND(2, 6);
+
+	add_body(&(Body){
+		.position = { RAND(20, 780), RAND(0, 560) },
+		.velocity = { RAND(-100.0, 100.0), RAND(-100.0, 100.0) },
+		.half_size = { HALF_SIZE(size), HALF_SIZE(RAND(2, 6)) },
+		.inv_mass = i % 16 == 0 ? 0 : 1 / RAND(5, 10),
+		.material = rand() % MATERIAL_COUNT,
+	}, -1);
 }
 
-static void mark_checked(int body1_id, int body2_id)
+/* 
+ * logs the touching pairs of every batch as (lower id << 32 | higher id),
+ * testing them in id order since check_collision can round differently
+ * when swapped
+ */
+static void
+record_pairs(ArrayBuffer *log)
 {
-	unsigned int element_size = (body_count + UINTMAX_BITS) / UINTMAX_BITS;
-	unsigned int body1_check_offset = body1_id * element_size;
-	unsigned int body2_element = body2_id / UINTMAX_BITS;
-	unsigned int body2_bit = body2_id % UINTMAX_BITS;
-	uintmax_t *element = ((uintmax_t*)body_already_checked_buffer.data) + body1_check_offset + body2_element;
+	Float position[2], normal[2], pen_vector[2];
+
+	for(int batch = 0; batch < PAIR_BATCHES; batch++) {
+		const BodyPair *pairs = pair_batch[batch].data;
+		int count = arrbuf_length(&pair_batch[batch], sizeof(BodyPair));
+
+		for(int i = 0; i < count; i++) {
+			uint64_t a = pairs[i].a < pairs[i].b ? pairs[i].a : pairs[i].b;
+			uint64_t b = pairs[i].a < pairs[i].b ? pairs[i].b : pairs[i].a;
+
+			if(check_collision(&body_list[a], &body_list[b], PHYSICS_TIME, position, normal, pen_vector))
+				arrbuf_insert(log, sizeof(uint64_t), &(uint64_t){ a << 32 | b });
+		}
+	}
+}
 
-	*element |= (1 << body2_bit);
+static int
+compare_pair(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
 }
 
-int
-main()
+/* 
+ * headless timing of a generated scene, count 0 sweeps from
+ * BENCH_MIN_BODIES up to N_BODY doubling each time. every count runs in
+ * its own process so they all start from a clean world.
+ */
+static int
+run_bench(int scene, int count, unsigned int seed, int steps)
 {
-	SDL_Init(SDL_INIT_VIDEO);
-	window = SDL_CreateWindow("hello",
-			SDL_WINDOWPOS_CENTERED,
-			SDL_WINDOWPOS_CENTERED,
-			800, 600,
-			SDL_WINDOW_OPENGL);
-	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+	int status, failed = 0;
 
-	arrbuf_init(&body_node_buffer);
-	arrbuf_init(&body_already_checked_buffer);
-	clear_lists();
+	if(count > 0)
+		return bench_scene(scene, count, seed, steps);
 
-	body_count = 5;
-	body_list[0].position[0] = 400;
-	body_list[0].position[1] = 500;
-	body_list[0].half_size[0] = 100;
-	body_list[0].half_size[1] = 5;
-	body_list[0].velocity[0] = 0;
-	body_list[0].velocity[1] = 0;
-	body_list[0].acceleration[0] = 0;
-	body_list[0].acceleration[1] = 0;
-	body_list[0].is_static = 1;
-	body_list[0].restitution = 0.5;
-	body_list[0].mass = 10.0;
-
-	body_list[1].position[0] = 500;
-	body_list[1].position[1] = 400;
-	body_list[1].half_size[0] = 5;
-	body_list[1].half_size[1] = 100;
-	body_list[1].velocity[0] = 0;
-	body_list[1].velocity[1] = 0;
-	body_list[1].acceleration[0] = 0;
-	body_list[1].acceleration[1] = 0;
-	body_list[1].is_static = 1;
-	body_list[1].restitution = 0.5;
-	body_list[1].mass = 10.0;
-
-	body_list[2].position[0] = 400;
-	body_list[2].position[1] = 550;
-	body_list[2].half_size[0] = 400;
-	body_list[2].half_size[1] = 10;
-	body_list[2].velocity[0] = 0;
-	body_list[2].velocity[1] = 0;
-	body_list[2].acceleration[0] = 0;
-	body_list[2].acceleration[1] = 0;
-	body_list[2].is_static = 1;
-	body_list[2].restitution = 0.5;
-	body_list[2].mass = 10.0;
-
-	body_list[3].position[0] = 5;
-	body_list[3].position[1] = 300;
-	body_list[3].half_size[0] = 10;
-	body_list[3].half_size[1] = 300;
-	body_list[3].velocity[0] = 0;
-	body_list[3].velocity[1] = 0;
-	body_list[3].acceleration[0] = 0;
-	body_list[3].acceleration[1] = 0;
-	body_list[3].is_static = 1;
-	body_list[3].restitution = 0.5;
-	body_list[3].mass = 10.0;
-
-	body_list[4].position[0] = 750;
-	body_list[4].position[1] = 300;
-	body_list[4].half_size[0] = 10;
-	body_list[4].half_size[1] = 300;
-	body_list[4].velocity[0] = 0;
-	body_list[4].velocity[1] = 0;
-	body_list[4].acceleration[0] = 0;
-	body_list[4].acceleration[1] = 0;
-	body_list[4].is_static = 1;
-	body_list[4].restitution = 0.5;
-	body_list[4].mass = 10.0;
+	for(count = BENCH_MIN_BODIES; count <= N_BODY; count *= 2) {
+		pid_t pid;
 
-	Uint64 prev_time = SDL_GetPerformanceCounter();
-	static float physics_time = 0;
-	static float add_time = 0;
-	static float fps_time = 0, physics_time_avg;
-	static int frames = 0;
-	for(;;) {
-		Uint64 curr_time = SDL_GetPerformanceCounter();
-		Float delta = (Float)(curr_time - prev_time) / SDL_GetPerformanceFrequency();
-		prev_time = curr_time;
-		if(delta > 0.25)
-			delta = 0.25;
-		
-		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-		SDL_RenderClear(renderer);
-		
-		physics_time += delta;
-		static int physics_count = 0;
-		if(physics_time > PHYSICS_TIME) {
-			Uint64 start = SDL_GetPerformanceCounter();
-			while(physics_time > PHYSICS_TIME) {
-				iterations++;
-				int count = 0;
-				arrbuf_clear(&body_already_checked_buffer);
-				count = ((body_count + UINTMAX_BITS) / UINTMAX_BITS) * body_count;
-
-				for(int i = 0; i < count; i++)
-					*(uintmax_t*)(arrbuf_newptr(&body_already_checked_buffer, sizeof(uintmax_t))) = 0;
-
-				calculate_grid();
-				max_object_count = 0;
-				for(int i = 0; i < GRID_BUFFER_SIZE; i++) {
-					object_count = 0;
-
-					solve_body_grid_list(grid_list[i], grid_list[i], delta);
-					solve_body_grid_list_static(grid_list[i], static_grid_list[i], delta);
-					if(object_count > max_object_count)
-						max_object_count = object_count;
-
-					object_sum += object_count;
-					if(object_count > 20)
-						count_20 ++;
-				}
-				for(int i = 0; i < body_count; i++)
-					update_body(&body_list[i], PHYSICS_TIME);
+		fflush(stdout);
+		if((pid = fork()) < 0)
+			die("fork failed\n");
+		if(pid == 0)
+			exit(bench_scene(scene, count, seed, steps));
+		waitpid(pid, &status, 0);
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-				physics_time -= PHYSICS_TIME;
-				physics_count ++;
-				static int flip = 0;
-				if(physics_count > PHYSICS_ITERATIONS * 0.005) {
-					flip = (flip + 1) % 2;
-					if(body_count < N_BODY) {
-						body_list[body_count].half_size[0] = RAND(2, 5);
-						body_list[body_count].half_size[1] = RAND(2, 5);
-						body_list[body_count].acceleration[0] = 0;
-						body_list[body_count].acceleration[1] = 0;
-						body_list[body_count].position[0] = 50 + flip * 500;
-						body_list[body_count].position[1] = 50;
-						body_list[body_count].velocity[0] = RAND(0.0, 200.0) * -(flip * 2 - 1);
-						body_list[body_count].velocity[1] = 0.0;
-						body_list[body_count].mass = RAND(5, 10);
-						body_list[body_count].restitution = RAND(0.0, 0.5);
-						body_count ++;
-					}
-					physics_count = 0;
-				}
-			}
-			Uint64 end = SDL_GetPerformanceCounter();
-			physics_time_avg += 1000.0 * (end - start) / SDL_GetPerformanceFrequency();
+static int
+bench_scene(int scene, int count, unsigned int seed, int steps)
+{
+	ArrayBuffer bodies;
+	const Body *list;
+	Uint64 start, end;
+	long pairs = 0, contacts = 0;
+	double seconds;
+	int n;
+
+	init_world();
+	chunk_streaming = 0;
+
+	arrbuf_init(&bodies);
+	generate_scene(&bodies, scene, count, seed);
+	list = bodies.data;
+	n = arrbuf_length(&bodies, sizeof(Body));
+	if(n > N_BODY)
+		die("%d bodies do not fit, build with a bigger N_BODY\n", n);
+	for(int i = 0; i < n; i++)
+		add_body(&list[i], -1);
+	arrbuf_free(&bodies);
+
+	start = SDL_GetPerformanceCounter();
+	for(int step = 0; step < steps; step++) {
+		step_world();
+		for(int i = 0; i < PAIR_BATCHES; i++) {
+			pairs += arrbuf_length(&pair_batch[i], sizeof(BodyPair));
+			contacts += arrbuf_length(&contact_batch[i], sizeof(Contact));
 		}
+	}
+	end = SDL_GetPerformanceCounter();
+	seconds = (double)(end - start) / SDL_GetPerformanceFrequency();
 
-		frames++;
-		fps_time += delta; 
-		if(fps_time > 1.0) {
-			printf("FPS: %d | SYM_TIME: %f | BODY_COUNT: %d | MAX: %d | AVG: %f | 20: %f\n",
-					frames,
-					physics_time_avg / frames,
-					body_count, 
-					max_object_count, 
-					object_sum / (float)(iterations * GRID_BUFFER_SIZE), 
-					(float)count_20 / iterations);
+	printf("BENCH: %s | seed %u | bodies %d | steps %d | pairs %ld/step | contacts %ld/step | TIME: %f ms/step | %f ns/body\n",
+			scene_names[scene], seed, body_count, steps, pairs / steps, contacts / steps,
+			1000.0 * seconds / steps, 1e9 * seconds / steps / body_count);
+	return EXIT_SUCCESS;
+}
 
-			count_20 = 0;
-			object_sum = 0;
-			frames = 0;
-			physics_time_avg = 0;
-			fps_time = 0;
-			iterations = 0;
+static int
+find_scene(const char *name)
+{
+	for(int i = 0; i < SCENE_COUNT; i++)
+		if(strcmp(name, scene_names[i]) == 0)
+			return i;
+	die("unknown scene %s\n", name);
+	return -1;
+}
+
+/* 
+ * count bodies of the given layout, walls and tiles included, in a
+ * square box with one body per SCENE_SPACING squared. the same seed
+ * always gives the same scene.
+ */
+static void
+generate_scene(ArrayBuffer *scene, int type, int count, unsigned int seed)
+{
+	Float side = SCENE_SPACING * sqrt(count);
+	Body *b;
+
+	srand(seed);
+
+	/* floor and walls */
+	*(Body*)arrbuf_newptr(scene, sizeof(Body)) = scene_body(side * 0.5, side + 10, side * 0.5 + 20, 10);
+	*(Body*)arrbuf_newptr(scene, sizeof(Body)) = scene_body(-10, side * 0.5, 10, side * 0.5);
+	*(Body*)arrbuf_newptr(scene, sizeof(Body)) = scene_body(side + 10, side * 0.5, 10, side * 0.5);
+	count = count > 3 ? count - 3 : 0;
+
+	switch(type) {
+	case SCENE_UNIFORM:
+		for(int i = 0; i < count; i++) {
+			b = arrbuf_newptr(scene, sizeof(Body));
+			*b = scene_body(RAND(0, side), RAND(0, side), RAND(2, 5), RAND(2, 5));
+			b->velocity[0] = RAND(-100.0, 100.0);
+			b->velocity[1] = RAND(-100.0, 100.0);
+			b->inv_mass = 1 / RAND(5, 10);
+		}
+		break;
+	case SCENE_CLUSTERS: {
+		int clusters = count / SCENE_CLUSTER_BODIES + 1;
+		Float radius = SCENE_SPACING * 0.25 * sqrt(SCENE_CLUSTER_BODIES);
+		Float (*center)[2] = emalloc(clusters * sizeof(center[0]));
+
+		for(int i = 0; i < clusters; i++) {
+			center[i][0] = RAND(radius, side - radius);
+			center[i][1] = RAND(radius, side - radius);
+		}
+		/* two samples averaged, denser in the middle */
+		for(int i = 0; i < count; i++) {
+			Float *c = center[i % clusters];
+
+			b = arrbuf_newptr(scene, sizeof(Body));
+			*b = scene_body(c[0] + (RAND(-radius, radius) + RAND(-radius, radius)) * 0.5,
+					c[1] + (RAND(-radius, radius) + RAND(-radius, radius)) * 0.5,
+					RAND(2, 5), RAND(2, 5));
+			b->inv_mass = 1 / RAND(5, 10);
+		}
+		efree(center);
+		break;
+	}
+	case SCENE_PILES: {
+		int piles = sqrt(count) / SCENE_PILE_WIDTH + 1;
+
+		/* columns of neatly stacked boxes with a gap, they fall and settle */
+		for(int i = 0; i < count; i++) {
+			int pile = i % piles, slot = i / piles;
+			Float x = (pile + FLOAT_C(0.5)) * side / piles;
+
+			b = arrbuf_newptr(scene, sizeof(Body));
+			*b = scene_body(x + (slot % SCENE_PILE_WIDTH - SCENE_PILE_WIDTH * 0.5) * 10,
+					side - 10 - (slot / SCENE_PILE_WIDTH) * 11, 4, 4);
+			b->inv_mass = 1 / RAND(5, 10);
+		}
+		break;
+	}
+	case SCENE_TILEMAP: {
+		int columns = side / (2 * SCENE_TILE_SIZE) + 1, tiles = count / 2;
+		int *height = emalloc(columns * sizeof(int));
+		int average = tiles / columns + 1, sum = 0;
+
+		/* random walk terrain, half of the bodies are its tiles */
+		height[0] = average;
+		for(int i = 1; i < columns; i++) {
+			height[i] = height[i - 1] + rand() % 3 - 1;
+			if(height[i] < 1)
+				height[i] = 1;
+			if(height[i] > 2 * average)
+				height[i] = 2 * average;
 		}
 
-		for(int i = 0; i < body_count; i++)
-			render_body(&body_list[i]);
+		/* even it out until the columns hold exactly the tiles */
+		for(int i = 0; i < columns; i++)
+			sum += height[i];
+		for(int i = 0; sum < tiles; i = (i + 1) % columns, sum++)
+			height[i]++;
+		for(int i = 0; sum > tiles; i = (i + 1) % columns) {
+			if(height[i] > 0) {
+				height[i]--;
+				sum--;
+			}
+		}
 
-		SDL_RenderPresent(renderer);
-		SDL_Event event;
-		while(SDL_PollEvent(&event)) {
-			switch(event.type) {
-			case SDL_QUIT:
-				goto end_game;
-				break;
+		for(int i = 0; i < columns; i++) {
+			for(int row = 0; row < height[i]; row++) {
+				*(Body*)arrbuf_newptr(scene, sizeof(Body)) = scene_body(
+						(2 * i + 1) * SCENE_TILE_SIZE, side - (2 * row + 1) * SCENE_TILE_SIZE,
+						SCENE_TILE_SIZE, SCENE_TILE_SIZE);
 			}
 		}
+		count -= tiles;
+		efree(height);
+		for(int i = 0; i < count; i++) {
+			b = arrbuf_newptr(scene, sizeof(Body));
+			*b = scene_body(RAND(0, side), RAND(0, side * 0.5), RAND(2, 5), RAND(2, 5));
+			b->inv_mass = 1 / RAND(5, 10);
+		}
+		break;
 	}
+	case SCENE_MIXED:
+		/* mostly small with a tail over every grid level, a few of them static */
+		for(int i = 0; i < count; i++) {
+			Float size = 2 * pow(2, 5 * RAND_FLOAT * RAND_FLOAT * RAND_FLOAT);
+
+			b = arrbuf_newptr(scene, sizeof(Body));
+			*b = scene_body(RAND(0, side), RAND(0, side), size, size * RAND(0.5, 1.0));
+			b->velocity[0] = RAND(-100.0, 100.0);
+			b->inv_mass = i % 8 == 0 ? 0 : 1 / (size * size);
+		}
+		break;
+	}
+}
 
-end_game:
-	SDL_DestroyRenderer(renderer);
-	SDL_DestroyWindow(window);
-	SDL_Quit();
-
-	return 0;
+/* a static body with a random material, callers make it dynamic */
+static Body
+scene_body(Float x, Float y, Float w, Float h)
+{
+	return (Body){
+		.position = { x, y },
+		.half_size = { HALF_SIZE(w), HALF_SIZE(h) },
+		.material = rand() % MATERIAL_COUNT,
+	};
 }
 
 int
@@ -298,8 +2407,8 @@ check_collision(Body *body, Body *body2, Float delta, Float hit_position[2], Flo
 	Float dt[2], ht[2];
 
 	Float first_exit = INFINITY, last_entry = -INFINITY;
-	total_hs[0] = body->half_size[0] + body2->half_size[0];
-	total_hs[1] = body->half_size[1] + body2->half_size[1];
+	total_hs[0] = BODY_HALF(body, 0) + BODY_HALF(body2, 0);
+	total_hs[1] = BODY_HALF(body, 1) + BODY_HALF(body2, 1);
 	velocity[0] = body2->velocity[0] - body->velocity[0];
 	velocity[1] = body2->velocity[1] - body->velocity[1];
 
@@ -312,8 +2421,8 @@ check_collision(Body *body, Body *body2, Float delta, Float hit_position[2], Flo
 
 	dt[0] = body2->position[0] - body->position[0];
 	dt[1] = body2->position[1] - body->position[1];
-	ht[0] = total_hs[0] - fabsf(dt[0]);
-	ht[1] = total_hs[1] - fabsf(dt[1]);
+	ht[0] = total_hs[0] - FABS(dt[0]);
+	ht[1] = total_hs[1] - FABS(dt[1]);
 	hit_normal[0] = (ht[0] < ht[1]) * ((dt[0] > 0) - (dt[0] < 0));
 	hit_normal[1] = (ht[0] > ht[1]) * ((dt[1] > 0) - (dt[1] < 0));
 	pen_vector[0] = ht[0] * hit_normal[0];
@@ -355,109 +2464,165 @@ solve_body_grid_list_static(int grid_list, int grid_other, Float delta)
 	}
 }
 
+/* 
+ * the pair is solved only at the cell holding the corner of the overlap
+ * of both cell ranges, so bodies spanning several cells are not solved
+ * twice.
+ */
+static int
+home_cell(BodyNodeList *a, BodyNodeList *b)
+{
+	return (a->min[0] > b->min[0] ? a->min[0] : b->min[0]) == a->cell[0] &&
+	       (a->min[1] > b->min[1] ? a->min[1] : b->min[1]) == a->cell[1];
+}
+
 void
 solve_body_grid(int body_node, int other_body, Float delta)
 {
-	Body *body = blist(body_node)->body;
-	Body *body2 = blist(other_body)->body;
-	test_and_solve(body, body2, delta);
+	if(!home_cell(blist(body_node), blist(other_body)))
+		return;
+
+	emit_pair(PAIR_DYNAMIC, blist(body_node)->body, blist(other_body)->body);
 }
 
 void
 solve_body_grid_static(int body_node, int other_body, Float delta)
 {
-	Body *body = blist(body_node)->body;
-	Body *body2 = blist(other_body)->body;
-	test_and_solve_static(body, body2, delta);
+	if(!home_cell(blist(body_node), blist(other_body)))
+		return;
+
+	emit_pair(PAIR_STATIC, blist(body_node)->body, blist(other_body)->body);
 }
 
-void
-solve_body(Body *body, Float delta) 
+/* 
+ * bodies on different levels never share a cell, so each body looks up
+ * the coarser levels itself; static bodies do it too so small static
+ * tiles still see big dynamic bodies.
+ */
+static void
+solve_body_cross_level(Body *b)
 {
-	for(int i = (int)(body - body_list) + 1; i < body_count; i++) {
-		Float position[2], normal[2], pen_vector[2];
-		if(check_collision(body, &body_list[i], delta, position, normal, pen_vector)) {
-			float j;
-			Float relative_vel[2];
+	int level = body_level[b - body_list];
+
+	for(int l = level + 1; l < GRID_LEVELS; l++) {
+		if(grid_level_count[l])
+			query_grid_level(b, l, 0);
+		if(static_grid_level_count[l] && !grid_static[b - body_list])
+			query_grid_level(b, l, 1);
+	}
+}
+
+static void
+query_grid_level(Body *b, int level, int is_static)
+{
+	int min[2], max[2];
 
-			relative_vel[0] = body->velocity[0] - body_list[i].velocity[0];
-			relative_vel[1] = body->velocity[1] - body_list[i].velocity[1];
-			j = relative_vel[0] * normal[0] + relative_vel[1] * normal[1];
-			j *= -(1 + 0.5);
-			j /= 2.0;
+	grid_range(b, level, min, max);
+	for(int x = min[0]; x <= max[0]; x++)
+	for(int y = min[1]; y <= max[1]; y++) {
+		GridCell *cell = grid_cell(level, x, y, 0);
+		if(!cell)
+			continue;
 
-			body->position[0] -= pen_vector[0] * 0.5;
-			body->position[1] -= pen_vector[1] * 0.5;
-			body_list[i].position[0] += pen_vector[0] * 0.5;
-			body_list[i].position[1] += pen_vector[1] * 0.5;
+		int node = is_static ? cell->static_bodies : cell->bodies;
+		for(; node >= 0; node = blist(node)->next) {
+			BodyNodeList *n = blist(node);
 
-			body->velocity[0]        += normal[0] * (j);
-			body->velocity[1]        += normal[1] * (j);
-			body_list[i].velocity[0] -= normal[0] * (j);
-			body_list[i].velocity[1] -= normal[1] * (j);
+			if((min[0] > n->min[0] ? min[0] : n->min[0]) != x ||
+			   (min[1] > n->min[1] ? min[1] : n->min[1]) != y)
+				continue;
+
+			if(grid_static[b - body_list])
+				emit_pair(PAIR_STATIC, n->body, b);
+			else
+				emit_pair(is_static ? PAIR_STATIC : PAIR_DYNAMIC, b, n->body);
 		}
 	}
+}
 
-	if(body->position[0] < 0) {
-		body->velocity[0] = 0.0;
-		body->acceleration[0] = 0.0;
-		body->position[0] = 0;
-	}
+static void
+emit_pair(int batch, Body *body, Body *body2)
+{
+	*(BodyPair*)arrbuf_newptr(&pair_batch[batch], sizeof(BodyPair)) = (BodyPair){
+		.a = body - body_list,
+		.b = body2 - body_list
+	};
+}
 
-	if(body->position[1] < 0) {
-		body->velocity[1] = 0.0;
-		body->acceleration[1] = 0.0;
-		body->position[1] = 0;
-	}
+/* 
+ * reference all-pairs broadphase, slow but trivially complete, verify
+ * mode checks the grid against it
+ */
+void
+solve_body(Body *body, Float delta) 
+{
+	for(int i = (int)(body - body_list) + 1; i < body_count; i++) {
+		Body *other = &body_list[i];
 
-	if(body->position[0] > 800 - body->half_size[0]) {
-		body->velocity[0] = 0.0;
-		body->acceleration[0] = 0.0;
-		body->position[0] = 800 - body->half_size[0];
-	}
+		if(BODY_STATIC(body) && BODY_STATIC(other))
+			continue;
 
-	if(body->position[1] > 600 - body->half_size[1]) {
-		body->velocity[1] = 0.0;
-		body->acceleration[1] = 0.0;
-		body->position[1] = 600 - body->half_size[1];
+		if(BODY_STATIC(other))
+			emit_pair(PAIR_STATIC, body, other);
+		else if(BODY_STATIC(body))
+			emit_pair(PAIR_STATIC, other, body);
+		else
+			emit_pair(PAIR_DYNAMIC, body, other);
 	}
 }
 
 void
 update_body(Body *body, Float delta) 
 {
-	Float velocity[2];
+	if(!BODY_STATIC(body))
+		body->velocity[1] += GRAVITY * delta;
+}
 
-	if(!body->is_static) {
-		body->acceleration[1] = 19.4 * 4;
-		body->velocity[0] += body->acceleration[0] * delta;
-		body->velocity[1] += body->acceleration[1] * delta;
-		body->position[0] += body->velocity[0] * delta;
-		body->position[1] += body->velocity[1] * delta;
-		body->acceleration[0] = 0;
-		body->acceleration[1] = 0;
+/* 
+ * handles are looked up here and not when queued, chunk streaming may
+ * have moved or frozen the body since
+ */
+static void
+apply_forces()
+{
+	Force *forces = body_forces.data;
+	int count = arrbuf_length(&body_forces, sizeof(Force));
+
+	for(int i = 0; i < count; i++) {
+		int slot = handle_slot(forces[i].handle);
+		int id = slot < 0 ? -1 : handle_body[slot];
+		Body *body;
+
+		if(id < 0 || !body_rate[id])
+			continue;
+		body = &body_list[id];
+		body->velocity[0] += forces[i].force[0] * body->inv_mass * PHYSICS_TIME * body_rate[id];
+		body->velocity[1] += forces[i].force[1] * body->inv_mass * PHYSICS_TIME * body_rate[id];
 	}
+	arrbuf_clear(&body_forces);
 }
 
-void
-render_body(Body *body) 
+/* positions move after the solver fixed the velocities */
+static void
+move_body(Body *body, Float delta)
 {
-	SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
-	SDL_RenderDrawRect(renderer, &(SDL_Rect){
-		.x = body->position[0] - body->half_size[0],
-		.y = body->position[1] - body->half_size[1],
-		.w = body->half_size[0] * 2.0,
-		.h = body->half_size[1] * 2.0
-	});
+	if(!BODY_STATIC(body)) {
+		body->position[0] += body->velocity[0] * delta;
+		body->position[1] += body->velocity[1] * delta;
+	}
 }
 
 static void
-add_body_list(int *body_list, Body *b) 
+add_body_list(int *body_list, Body *b, int x, int y, int min_x, int min_y) 
 {
 	BodyNodeList *new = arrbuf_newptr(&body_node_buffer, sizeof(BodyNodeList));
 	int id =  (int)(new - (BodyNodeList*)body_node_buffer.data);
 
 	new->body = b;
+	new->cell[0] = x;
+	new->cell[1] = y;
+	new->min[0] = min_x;
+	new->min[1] = min_y;
 	new->next = *body_list;
 
 	if(*body_list >= 0)
@@ -478,9 +2643,24 @@ blist(int id)
 static void 
 clear_lists()
 {
-	for(int i = 0; i < GRID_BUFFER_SIZE; i++) {
-		grid_list[i] = -1;
-		static_grid_list[i] = -1;
+	if(!grid_cells) {
+		grid_cells = emalloc(GRID_CELLS_MIN * sizeof(GridCell));
+		grid_cells_mask = GRID_CELLS_MIN - 1;
+		memset(grid_cells, 0, GRID_CELLS_MIN * sizeof(GridCell));
+	}
+
+	shrink_grid_cells();
+
+	/* generation 0 marks never used slots, so wrap around by wiping */
+	if(++grid_generation == 0) {
+		memset(grid_cells, 0, (grid_cells_mask + 1) * sizeof(GridCell));
+		grid_generation = 1;
+	}
+	arrbuf_clear(&grid_occupied);
+
+	for(int i = 0; i < GRID_LEVELS; i++) {
+		grid_level_count[i] = 0;
+		static_grid_level_count[i] = 0;
 	}
 	arrbuf_clear(&body_node_buffer);
 }
@@ -488,87 +2668,336 @@ clear_lists()
 static void
 calculate_grid()
 {
+	if(grid_tile_body_count != body_count)
+		select_grid_tile_size();
+
 	clear_lists();
-	for(int i = 0; i < body_count; i++)
-		calculate_grid_body(&body_list[i]);
+	arrbuf_clear(&grid_bodies);
+	for(int i = 0; i < body_count; i++) {
+		int role = grid_role(i);
+
+		if(role != GRID_ROLE_NONE)
+			calculate_grid_body(&body_list[i], role == GRID_ROLE_STATIC);
+	}
 }
 
+/* 
+ * picks the base cell as the median body extent rounded up to a power
+ * of two, using a histogram of log2 sizes so it stays O(n).
+ */
 static void
-calculate_grid_body(Body *b)
+select_grid_tile_size()
 {
-	int x, x_max;
-	int y, y_max;
-	int count;
-	
-	x     = floorf((b->position[0] - b->half_size[0]) / GRID_TILE_SIZE);
-	x_max = floorf((b->position[0] + b->half_size[0]) / GRID_TILE_SIZE);
-	y_max = floorf((b->position[1] + b->half_size[1]) / GRID_TILE_SIZE);
-
-	for(; x <= x_max; x++) {
-		y = floorf((b->position[1] - b->half_size[1]) / GRID_TILE_SIZE);
-		for(; y <= y_max; y++) {
-			int hash = hash_pos(x, y);
-			
-			if(b->is_static)
-				add_body_list(&static_grid_list[hash], b);
-			else
-				add_body_list(&grid_list[hash], b);
-		}
+	int histogram[GRID_LEVELS + 8] = { 0 };
+	int size, bucket, sum;
+
+	grid_tile_body_count = body_count;
+	if(body_count == 0)
+		return;
+
+	for(int i = 0; i < body_count; i++) {
+		Float extent = 2 * FMAX(BODY_HALF(&body_list[i], 0), BODY_HALF(&body_list[i], 1));
+
+		bucket = 0;
+		for(size = GRID_TILE_SIZE_MIN; size < extent && size < GRID_TILE_SIZE_MAX; size *= 2)
+			bucket++;
+		histogram[bucket]++;
+	}
+
+	sum = 0;
+	size = GRID_TILE_SIZE_MIN;
+	for(bucket = 0; sum + histogram[bucket] < (body_count + 1) / 2; bucket++) {
+		sum += histogram[bucket];
+		size *= 2;
 	}
+	grid_tile_size = size;
+}
+
+/* from the grown extent, it is what grid_range bins */
+static int
+grid_level(Body *b)
+{
+	Float fat[2], extent;
+	int level = 0;
+
+	fat_extent(b, fat);
+	extent = 2 * FMAX(fat[0], fat[1]);
+
+	while(level < GRID_LEVELS - 1 && (Float)(grid_tile_size << level) < extent)
+		level++;
+
+	return level;
+}
+
+static int
+grid_role(int id)
+{
+	if(body_rate[id])
+		return BODY_STATIC(&body_list[id]) ? GRID_ROLE_STATIC : GRID_ROLE_DYNAMIC;
+	if(body_ghost[id] || chunk_table[body_chunk[id]].border)
+		return GRID_ROLE_STATIC;
+	return GRID_ROLE_NONE;
 }
 
+/* half size grown by the reach until the next rebuild, both ways for bounces */
 static void
-test_and_solve(Body *body, Body *body2, Float delta)
+fat_extent(Body *b, Float fat[2])
 {
-	Float position[2], normal[2], pen_vector[2];
-	
-	if(check_collision(body, body2, delta, position, normal, pen_vector)) {
-		float j;
-		Float relative_vel[2];
-		
-		Float inertia_1 = 1.0 / body->mass;
-		Float inertia_2 = 1.0 / body2->mass;
-		Float total_mass = body->mass + body2->mass;
+	Float reach = PHYSICS_TIME * PAIR_REUSE_STEPS * body_rate[b - body_list];
+
+	fat[0] = BODY_HALF(b, 0) + FABS(b->velocity[0]) * reach + PAIR_MARGIN;
+	fat[1] = BODY_HALF(b, 1) + FABS(b->velocity[1]) * reach + PAIR_MARGIN;
+}
+
+static void
+grid_range(Body *b, int level, int min[2], int max[2])
+{
+	Float size = grid_tile_size << level;
+	Float fat[2];
+
+	fat_extent(b, fat);
+	min[0] = FLOOR((b->position[0] - fat[0]) / size);
+	min[1] = FLOOR((b->position[1] - fat[1]) / size);
+	max[0] = FLOOR((b->position[0] + fat[0]) / size);
+	max[1] = FLOOR((b->position[1] + fat[1]) / size);
+}
+
+static void
+calculate_grid_body(Body *b, int as_static)
+{
+	int min[2], max[2], id = b - body_list;
+	int level = grid_level(b);
+	Float fat[2];
+
+	body_level[id] = level;
+	grid_static[id] = as_static;
+	arrbuf_insert(&grid_bodies, sizeof(int), &(int){ id });
+	grid_range(b, level, min, max);
+
+	fat_extent(b, fat);
+	body_fat_origin[id][0] = b->position[0];
+	body_fat_origin[id][1] = b->position[1];
+	body_fat_slack[id][0] = fat[0] - BODY_HALF(b, 0);
+	body_fat_slack[id][1] = fat[1] - BODY_HALF(b, 1);
+
+	if(as_static)
+		static_grid_level_count[level]++;
+	else
+		grid_level_count[level]++;
+
+	for(int x = min[0]; x <= max[0]; x++)
+	for(int y = min[1]; y <= max[1]; y++) {
+		GridCell *cell = grid_cell(level, x, y, 1);
 		
-		relative_vel[0] = body->velocity[0] - body2->velocity[0];
-		relative_vel[1] = body->velocity[1] - body2->velocity[1];
-		j = relative_vel[0] * normal[0] + relative_vel[1] * normal[1];
-		j *= -(1 + body->restitution + body2->restitution);
-		j /= (inertia_1 + inertia_2);
+		if(as_static)
+			add_body_list(&cell->static_bodies, b, x, y, min[0], min[1]);
+		else
+			add_body_list(&cell->bodies, b, x, y, min[0], min[1]);
+	}
+}
+
+/* 
+ * linear probing keyed by the exact cell, so two cells never share a
+ * list; with create set a missing cell is added to the occupied list.
+ */
+static GridCell *
+grid_cell(int level, int x, int y, int create)
+{
+	unsigned int i;
+
+	if(create && (arrbuf_length(&grid_occupied, sizeof(int)) + 1) * 2 > grid_cells_mask + 1)
+		grow_grid_cells();
+
+	for(i = hash_pos(x, y, level) & grid_cells_mask;; i = (i + 1) & grid_cells_mask) {
+		GridCell *cell = &grid_cells[i];
+
+		if(cell->generation != grid_generation) {
+			if(!create)
+				return NULL;
+
+			cell->level = level;
+			cell->x = x;
+			cell->y = y;
+			cell->generation = grid_generation;
+			cell->bodies = -1;
+			cell->static_bodies = -1;
+			arrbuf_insert(&grid_occupied, sizeof(int), &(int){ i });
+			return cell;
+		}
+
+		if(cell->x == x && cell->y == y && cell->level == level)
+			return cell;
+	}
+}
+
+static void
+grow_grid_cells()
+{
+	GridCell *old = grid_cells;
+	int count = arrbuf_length(&grid_occupied, sizeof(int));
+	unsigned int size = (grid_cells_mask + 1) * 2;
 
-		body->position[0] -= pen_vector[0] * (body2->is_static ? 1.0 : body->mass / total_mass);
-		body->position[1] -= pen_vector[1] * (body2->is_static ? 1.0 : body->mass / total_mass);
-		body->velocity[0] += normal[0] * (j * inertia_1);
-		body->velocity[1] += normal[1] * (j * inertia_1);
+	grid_cells = emalloc(size * sizeof(GridCell));
+	grid_cells_mask = size - 1;
+	memset(grid_cells, 0, size * sizeof(GridCell));
 
-		body2->position[0] += pen_vector[0] * (body->is_static ? 1.0 : body2->mass / total_mass);
-		body2->position[1] += pen_vector[1] * (body->is_static ? 1.0 : body2->mass / total_mass);
-		body2->velocity[0] -= normal[0] * (j * inertia_2);
-		body2->velocity[1] -= normal[1] * (j * inertia_2);
+	for(int i = 0; i < count; i++) {
+		GridCell *cell = &old[((int*)grid_occupied.data)[i]];
+		unsigned int j = hash_pos(cell->x, cell->y, cell->level) & grid_cells_mask;
+
+		while(grid_cells[j].generation == grid_generation)
+			j = (j + 1) & grid_cells_mask;
+
+		grid_cells[j] = *cell;
+		((int*)grid_occupied.data)[i] = j;
 	}
+	efree(old);
 }
 
+/* 
+ * called while the grid is being cleared, nothing in the table is kept so
+ * a smaller one is just allocated empty. sized for the busiest of the
+ * sparse rebuilds, at least a quarter full.
+ */
 static void
-test_and_solve_static(Body *body, Body *stat, Float delta)
+shrink_grid_cells()
+{
+	int count = arrbuf_length(&grid_occupied, sizeof(int));
+	unsigned int size = grid_cells_mask + 1;
+
+	if(size <= GRID_CELLS_MIN || (unsigned int)count * 8 >= size) {
+		grid_sparse_rebuilds = 0;
+		grid_sparse_peak = 0;
+		return;
+	}
+
+	if(count > grid_sparse_peak)
+		grid_sparse_peak = count;
+	if(++grid_sparse_rebuilds < GRID_SHRINK_REBUILDS)
+		return;
+
+	while(size > GRID_CELLS_MIN && (unsigned int)grid_sparse_peak * 4 < size)
+		size /= 2;
+	efree(grid_cells);
+	grid_cells = emalloc(size * sizeof(GridCell));
+	grid_cells_mask = size - 1;
+	memset(grid_cells, 0, size * sizeof(GridCell));
+	grid_generation = 0;
+	grid_sparse_rebuilds = 0;
+	grid_sparse_peak = 0;
+}
+
+/* 
+ * builds the contact of a pair if it touches, dynamic and restitution are
+ * always constants so each kernel below gets its own copy with the other
+ * branches folded away
+ */
+static inline void
+prepare_contact(Body *body, Body *body2, int a, int b, ArrayBuffer *contacts, const int dynamic, const int restitution)
 {
 	Float position[2], normal[2], pen_vector[2];
-	
-	if(check_collision(body, stat, delta, position, normal, pen_vector)) {
-		float j;
-		Float relative_vel[2];
-		
-		Float inertia_1 = body->is_static ? 0 : 1.0 / body->mass;
-		Float total_mass = body->mass;
-		
-		relative_vel[0] = body->velocity[0];
-		relative_vel[1] = body->velocity[1];
-		j = relative_vel[0] * normal[0] + relative_vel[1] * normal[1];
-		j *= -(1 + body->restitution + stat->restitution);
-		j /= (inertia_1);
+	Float approach, penetration, delta;
+	Contact *contact;
+
+	/* low rate bodies move body_rate steps at once, correct over that much */
+	delta = PHYSICS_TIME * (dynamic && body_rate[b] > body_rate[a] ? body_rate[b] : body_rate[a]);
+	if(!check_collision(body, body2, delta, position, normal, pen_vector))
+		return;
+
+	body_contacts[a]++;
+	if(dynamic)
+		body_contacts[b]++;
+
+	penetration = pen_vector[0] * normal[0] + pen_vector[1] * normal[1];
+	approach = (body->velocity[0] - (dynamic ? body2->velocity[0] : 0)) * normal[0] +
+	           (body->velocity[1] - (dynamic ? body2->velocity[1] : 0)) * normal[1];
+
+	contact = arrbuf_newptr(contacts, sizeof(Contact));
+	contact->a = a;
+	contact->b = b;
+	contact->normal[0] = normal[0];
+	contact->normal[1] = normal[1];
+	contact->mass = FLOAT_C(1.0) / (body->inv_mass + (dynamic ? body2->inv_mass : 0));
+	contact->friction = material_pairs[body->material][body2->material].friction;
+	contact->normal_impulse = 0;
+	contact->tangent_impulse = 0;
+
+	/* soft push out of the overlap instead of moving the bodies */
+	contact->bias = penetration > SOLVER_SLOP ? -SOLVER_BAUMGARTE / delta * (penetration - SOLVER_SLOP) : 0;
+	if(restitution && approach > SOLVER_BOUNCE_SPEED)
+		contact->bias -= (material_pairs[body->material][body2->material].bounce - 1) * approach;
+}
 
-		body->position[0] -= pen_vector[0];
-		body->position[1] -= pen_vector[1];
-		body->velocity[0] += normal[0] * (j * inertia_1);
-		body->velocity[1] += normal[1] * (j * inertia_1);
+/* 
+ * one sequential impulse pass: normal impulse clamped to push only,
+ * friction clamped to the Coulomb cone of the current normal impulse
+ */
+static inline void
+solve_contact(Contact *contact, const int dynamic)
+{
+	Body *body = &body_list[contact->a];
+	Body *body2 = &body_list[contact->b];
+	Float tangent[2] = { -contact->normal[1], contact->normal[0] };
+	Float relative_vel[2], impulse, total, limit;
+
+	relative_vel[0] = body->velocity[0] - (dynamic ? body2->velocity[0] : 0);
+	relative_vel[1] = body->velocity[1] - (dynamic ? body2->velocity[1] : 0);
+
+	impulse = contact->mass * (relative_vel[0] * contact->normal[0] + relative_vel[1] * contact->normal[1] - contact->bias);
+	total = contact->normal_impulse + impulse;
+	if(total < 0)
+		total = 0;
+	impulse = total - contact->normal_impulse;
+	contact->normal_impulse = total;
+
+	body->velocity[0] -= contact->normal[0] * impulse * body->inv_mass;
+	body->velocity[1] -= contact->normal[1] * impulse * body->inv_mass;
+	if(dynamic) {
+		body2->velocity[0] += contact->normal[0] * impulse * body2->inv_mass;
+		body2->velocity[1] += contact->normal[1] * impulse * body2->inv_mass;
+	}
+
+	relative_vel[0] = body->velocity[0] - (dynamic ? body2->velocity[0] : 0);
+	relative_vel[1] = body->velocity[1] - (dynamic ? body2->velocity[1] : 0);
+
+	impulse = contact->mass * (relative_vel[0] * tangent[0] + relative_vel[1] * tangent[1]);
+	limit = contact->friction * contact->normal_impulse;
+	total = contact->tangent_impulse + impulse;
+	if(total > limit)
+		total = limit;
+	if(total < -limit)
+		total = -limit;
+	impulse = total - contact->tangent_impulse;
+	contact->tangent_impulse = total;
+
+	body->velocity[0] -= tangent[0] * impulse * body->inv_mass;
+	body->velocity[1] -= tangent[1] * impulse * body->inv_mass;
+	if(dynamic) {
+		body2->velocity[0] += tangent[0] * impulse * body2->inv_mass;
+		body2->velocity[1] += tangent[1] * impulse * body2->inv_mass;
 	}
 }
+
+#define DEFINE_PREPARE_KERNEL(NAME, DYNAMIC, RESTITUTION) \
+	static void \
+	NAME(const BodyPair *pairs, int count, ArrayBuffer *contacts) \
+	{ \
+		for(int i = 0; i < count; i++) \
+			prepare_contact(&body_list[pairs[i].a], &body_list[pairs[i].b], \
+					pairs[i].a, pairs[i].b, contacts, DYNAMIC, RESTITUTION); \
+	}
+
+#define DEFINE_SOLVE_KERNEL(NAME, DYNAMIC) \
+	static void \
+	NAME(Contact *contacts, int count) \
+	{ \
+		for(int i = 0; i < count; i++) \
+			solve_contact(&contacts[i], DYNAMIC); \
+	}
+
+DEFINE_PREPARE_KERNEL(prepare_dynamic_contacts,           1, 1)
+DEFINE_PREPARE_KERNEL(prepare_dynamic_contacts_inelastic, 1, 0)
+DEFINE_PREPARE_KERNEL(prepare_static_contacts,            0, 1)
+DEFINE_PREPARE_KERNEL(prepare_static_contacts_inelastic,  0, 0)
+DEFINE_SOLVE_KERNEL(solve_dynamic_contacts, 1)
+DEFINE_SOLVE_KERNEL(solve_static_contacts,  0)
@@ -3,8 +3,68 @@
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <stdint.h>
 
+#define UTIL_INTERNAL
 #include "util.h"
+
+#ifdef ALLOC_TRACKING
+#include <pthread.h>
+
+#define ALLOC_SITES 512
+#define ALLOC_POINTERS_MIN 1024
+
+/* totals of one call site, the per step maximum only counts the stepping thread */
+typedef struct {
+	const char *file;
+	int line;
+	size_t allocs, reallocs, frees;
+	size_t moved;
+	size_t live, peak;
+	size_t step_max, busy_steps;
+} AllocSite;
+
+/* live block, kept in an open addressed table keyed by pointer */
+typedef struct {
+	uintptr_t ptr;
+	size_t size;
+	int site;
+} AllocBlock;
+
+static int    find_site(const char *file, int line);
+static size_t block_slot(uintptr_t ptr);
+static void   insert_block(uintptr_t ptr, size_t size, int site);
+static int    remove_block(uintptr_t ptr, AllocBlock *removed);
+static void   track_alloc(void *ptr, size_t size, const char *file, int line);
+static void   track_realloc(uintptr_t old, void *ptr, size_t size, const char *file, int line);
+static void   track_free(void *ptr);
+static int    compare_sites(const void *, const void *);
+
+static AllocSite alloc_sites[ALLOC_SITES];
+static AllocBlock *alloc_blocks;
+static size_t alloc_blocks_mask, alloc_block_count;
+static size_t alloc_steps, alloc_busy_steps, alloc_last_busy;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* set by the macros in util.h right before the call they wrap */
+static _Thread_local const char *site_file;
+static _Thread_local int site_line;
+
+/* 
+ * what this thread allocated since its last alloc_step, threads that
+ * never step (the renderer) are left out of the per step numbers
+ */
+static _Thread_local size_t step_counts[ALLOC_SITES];
+
+#define TRACK_ALLOC(PTR, SIZE, FILE, LINE) track_alloc(PTR, SIZE, FILE, LINE)
+#define TRACK_REALLOC(OLD, PTR, SIZE, FILE, LINE) track_realloc(OLD, PTR, SIZE, FILE, LINE)
+#define TRACK_FREE(PTR) track_free(PTR)
+#else
+#define TRACK_ALLOC(PTR, SIZE, FILE, LINE)
+#define TRACK_REALLOC(OLD, PTR, SIZE, FILE, LINE) ((void)(OLD))
+#define TRACK_FREE(PTR)
+#endif
+
 static void *readline_proc(FILE *fp, ArrayBuffer *buffer);
 
 void
@@ -13,6 +73,7 @@ arrbuf_init(ArrayBuffer *buffer)
 	buffer->size = 0;
 	buffer->reserved = 1;
 	buffer->data = malloc(1);
+	TRACK_ALLOC(buffer->data, 1, NULL, 0);
 }
 
 void
@@ -27,14 +88,17 @@ void
 arrbuf_reserve(ArrayBuffer *buffer, size_t size)
 {
 	int need_change = 0;
+	uintptr_t old = (uintptr_t)buffer->data;
 
 	while(buffer->reserved < buffer->size + size) {
 		buffer->reserved *= 2;
 		need_change = 1;
 	}
 
-	if(need_change)
+	if(need_change) {
 		buffer->data = realloc(buffer->data, buffer->reserved);
+		TRACK_REALLOC(old, buffer->data, buffer->reserved, NULL, 0);
+	}
 }
 
 void
@@ -90,6 +154,7 @@ arrbuf_poptop(ArrayBuffer *buffer, size_t element_size)
 void
 arrbuf_free(ArrayBuffer *buffer)
 {
+	TRACK_FREE(buffer->data);
 	free(buffer->data);
 }
 
@@ -157,7 +222,7 @@ readline(FILE *fp)
 	arrbuf_init(&buffer);
 	data = readline_proc(fp, &buffer);
 	if(!data)
-		free(buffer.data);
+		arrbuf_free(&buffer);
 	
 	return data;
 }
@@ -272,6 +337,7 @@ strview_str(StrView view)
 	size_t size = view.end - view.begin;
 	char *ptr = malloc(size + 1);
 
+	TRACK_ALLOC(ptr, size + 1, NULL, 0);
 	strview_str_mem(view, ptr, size + 1);
 
 	return ptr;
@@ -335,6 +401,7 @@ read_file(const char *path, size_t *s)
 	fseek(fp, 0, SEEK_SET);
 	
 	result = malloc(size);
+	TRACK_ALLOC(result, size, NULL, 0);
 	fread(result, 1, size, fp);
 	fclose(fp);
 
@@ -350,6 +417,7 @@ _emalloc(size_t size, const char *file, int line)
 	void *ptr = malloc(size);
 	if(!ptr)
 		die("malloc failed at %s:%d\n", file, line);
+	TRACK_ALLOC(ptr, size, file, line);
 	return ptr;
 }
 
@@ -360,15 +428,239 @@ _efree(void *ptr, const char *file, int line)
 		fprintf(stderr, "freeing null at %s:%d\n", file, line);
 		return;
 	}
+	TRACK_FREE(ptr);
 	free(ptr);
 }
 
 void *
 _erealloc(void *ptr, size_t size, const char *file, int line)
 {
+	uintptr_t old = (uintptr_t)ptr;
+
 	ptr = realloc(ptr, size);
 	if(!ptr) {
 		die("realloc failed at %s:%d\n", file, line);
 	}
+	TRACK_REALLOC(old, ptr, size, file, line);
     return ptr;								   
 }
+
+#ifdef ALLOC_TRACKING
+void
+alloc_site(const char *file, int line)
+{
+	site_file = file;
+	site_line = line;
+}
+
+/* 
+ * closes a step: the per step counts of every site go into their
+ * maximum, so the report shows the worst step and not the average
+ */
+void
+alloc_step(void)
+{
+	int busy = 0;
+
+	pthread_mutex_lock(&alloc_lock);
+	for(int i = 0; i < ALLOC_SITES; i++) {
+		AllocSite *site = &alloc_sites[i];
+
+		if(!step_counts[i])
+			continue;
+		if(step_counts[i] > site->step_max)
+			site->step_max = step_counts[i];
+		site->busy_steps++;
+		step_counts[i] = 0;
+		busy = 1;
+	}
+	alloc_steps++;
+	if(busy) {
+		alloc_busy_steps++;
+		alloc_last_busy = alloc_steps;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/* registered with atexit by the first tracked allocation */
+void
+alloc_report(void)
+{
+	AllocSite sites[ALLOC_SITES];
+	int count = 0;
+
+	pthread_mutex_lock(&alloc_lock);
+	for(int i = 0; i < ALLOC_SITES; i++)
+		if(alloc_sites[i].file)
+			sites[count++] = alloc_sites[i];
+	pthread_mutex_unlock(&alloc_lock);
+	qsort(sites, count, sizeof(AllocSite), compare_sites);
+
+	fprintf(stderr, "ALLOC: steps %zu | steps allocating %zu | last allocating step %zu\n",
+			alloc_steps, alloc_busy_steps, alloc_last_busy);
+	fprintf(stderr, "%-24s %10s %10s %10s %12s %12s %12s %10s %10s\n",
+			"site", "allocs", "reallocs", "frees", "moved", "live", "peak", "step max", "steps");
+	for(int i = 0; i < count; i++) {
+		char name[256];
+
+		snprintf(name, sizeof(name), "%s:%d", sites[i].file, sites[i].line);
+		fprintf(stderr, "%-24s %10zu %10zu %10zu %12zu %12zu %12zu %10zu %10zu\n",
+				name, sites[i].allocs, sites[i].reallocs, sites[i].frees, sites[i].moved,
+				sites[i].live, sites[i].peak, sites[i].step_max, sites[i].busy_steps);
+	}
+}
+
+static int
+find_site(const char *file, int line)
+{
+	static int registered;
+	uint_fast32_t h;
+
+	if(!file) {
+		file = site_file ? site_file : "unknown";
+		line = site_line;
+	}
+	h = line * 0x85EBCA77u;
+	for(const char *c = file; *c; c++)
+		h = h * 31 + *c;
+	if(!registered) {
+		registered = 1;
+		atexit(alloc_report);
+	}
+
+	for(int i = 0; i < ALLOC_SITES; i++) {
+		AllocSite *site = &alloc_sites[(h + i) % ALLOC_SITES];
+
+		if(!site->file) {
+			site->file = file;
+			site->line = line;
+		}
+		if(site->line == line && strcmp(site->file, file) == 0)
+			return site - alloc_sites;
+	}
+	die("alloc site table full at %s:%d\n", file, line);
+	return -1;
+}
+
+static size_t
+block_slot(uintptr_t ptr)
+{
+	uint64_t h = (uint64_t)ptr * 0x9E3779B97F4A7C15ull;
+	return (h >> 32) & alloc_blocks_mask;
+}
+
+static void
+insert_block(uintptr_t ptr, size_t size, int site)
+{
+	size_t i;
+
+	/* kept at most half full, grows with plain malloc so it is not tracked */
+	if(2 * (alloc_block_count + 1) > alloc_blocks_mask + 1 || !alloc_blocks) {
+		AllocBlock *old = alloc_blocks;
+		size_t old_size = alloc_blocks ? alloc_blocks_mask + 1 : 0;
+		size_t new_size = old_size ? old_size * 2 : ALLOC_POINTERS_MIN;
+
+		alloc_blocks = calloc(new_size, sizeof(AllocBlock));
+		if(!alloc_blocks)
+			die("could not grow the alloc block table\n");
+		alloc_blocks_mask = new_size - 1;
+		alloc_block_count = 0;
+		for(size_t j = 0; j < old_size; j++)
+			if(old[j].ptr)
+				insert_block(old[j].ptr, old[j].size, old[j].site);
+		free(old);
+	}
+
+	for(i = block_slot(ptr); alloc_blocks[i].ptr; i = (i + 1) & alloc_blocks_mask)
+		;
+	alloc_blocks[i] = (AllocBlock){ .ptr = ptr, .size = size, .site = site };
+	alloc_block_count++;
+}
+
+/* linear probing delete, moves back the entries that probed past the hole */
+static int
+remove_block(uintptr_t ptr, AllocBlock *removed)
+{
+	size_t i, j;
+
+	if(!alloc_blocks)
+		return 0;
+	for(i = block_slot(ptr); alloc_blocks[i].ptr != ptr; i = (i + 1) & alloc_blocks_mask)
+		if(!alloc_blocks[i].ptr)
+			return 0;
+
+	*removed = alloc_blocks[i];
+	alloc_block_count--;
+	for(j = (i + 1) & alloc_blocks_mask; alloc_blocks[j].ptr; j = (j + 1) & alloc_blocks_mask) {
+		size_t home = block_slot(alloc_blocks[j].ptr);
+
+		if(((j - home) & alloc_blocks_mask) >= ((j - i) & alloc_blocks_mask)) {
+			alloc_blocks[i] = alloc_blocks[j];
+			i = j;
+		}
+	}
+	alloc_blocks[i].ptr = 0;
+	return 1;
+}
+
+static void
+track_alloc(void *ptr, size_t size, const char *file, int line)
+{
+	AllocSite *site;
+
+	pthread_mutex_lock(&alloc_lock);
+	site = &alloc_sites[find_site(file, line)];
+	site->allocs++;
+	step_counts[site - alloc_sites]++;
+	site->live += size;
+	if(site->live > site->peak)
+		site->peak = site->live;
+	insert_block((uintptr_t)ptr, size, site - alloc_sites);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/* the old block stays charged to whoever allocated it until here */
+static void
+track_realloc(uintptr_t old, void *ptr, size_t size, const char *file, int line)
+{
+	AllocBlock block;
+	AllocSite *site;
+
+	pthread_mutex_lock(&alloc_lock);
+	site = &alloc_sites[find_site(file, line)];
+	site->reallocs++;
+	step_counts[site - alloc_sites]++;
+	if(remove_block(old, &block)) {
+		alloc_sites[block.site].live -= block.size;
+		if((uintptr_t)ptr != old)
+			site->moved += block.size < size ? block.size : size;
+	}
+	site->live += size;
+	if(site->live > site->peak)
+		site->peak = site->live;
+	insert_block((uintptr_t)ptr, size, site - alloc_sites);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+static void
+track_free(void *ptr)
+{
+	AllocBlock block;
+
+	pthread_mutex_lock(&alloc_lock);
+	if(remove_block((uintptr_t)ptr, &block)) {
+		alloc_sites[block.site].frees++;
+		alloc_sites[block.site].live -= block.size;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+static int
+compare_sites(const void *a, const void *b)
+{
+	const AllocSite *x = a, *y = b;
+	size_t nx = x->allocs + x->reallocs, ny = y->allocs + y->reallocs;
+
+	return (nx < ny) - (nx > ny);
+}
+#endif
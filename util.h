@@ -73,4 +73,33 @@ void *_emalloc(size_t size, const char *file, int line);
 void  _efree(void *ptr, const char *file, int line);
 void *_erealloc(void *ptr, size_t size, const char *file, int line);
 
+/* 
+ * build with -DALLOC_TRACKING to count what every call site allocates,
+ * alloc_step closes a step of the calling thread and the report is
+ * printed to stderr at exit.
+ * the macros below tag ArrayBuffer calls with their call site.
+ */
+#ifdef ALLOC_TRACKING
+void alloc_site(const char *file, int line);
+void alloc_step(void);
+void alloc_report(void);
+
+#ifndef UTIL_INTERNAL
+#define ALLOC_SITE alloc_site(__FILE__, __LINE__)
+#define arrbuf_init(...) (ALLOC_SITE, arrbuf_init(__VA_ARGS__))
+#define arrbuf_reserve(...) (ALLOC_SITE, arrbuf_reserve(__VA_ARGS__))
+#define arrbuf_insert(...) (ALLOC_SITE, arrbuf_insert(__VA_ARGS__))
+#define arrbuf_insert_at(...) (ALLOC_SITE, arrbuf_insert_at(__VA_ARGS__))
+#define arrbuf_newptr(...) (ALLOC_SITE, arrbuf_newptr(__VA_ARGS__))
+#define arrbuf_newptr_at(...) (ALLOC_SITE, arrbuf_newptr_at(__VA_ARGS__))
+#define arrbuf_printf(...) (ALLOC_SITE, arrbuf_printf(__VA_ARGS__))
+#define arrbuf_free(...) (ALLOC_SITE, arrbuf_free(__VA_ARGS__))
+#define readline(...) (ALLOC_SITE, readline(__VA_ARGS__))
+#define strview_str(...) (ALLOC_SITE, strview_str(__VA_ARGS__))
+#define read_file(...) (ALLOC_SITE, read_file(__VA_ARGS__))
+#endif
+#else
+#define alloc_step()
+#endif
+
 #endif